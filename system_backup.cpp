@@ -10,9 +10,30 @@
 #include <comdef.h>
 #include <memory>
 #include <algorithm>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <map>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <psapi.h>          // For K32GetProcessMemoryInfo
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PATH_TEXT_SSE2 1    // see AppendUtf8 and FoldPathCase
+#include <emmintrin.h>
+#endif
 
 // Link with vssapi.lib (MSVC will also link needed Windows libraries)
 #pragma comment(lib, "vssapi.lib")
+#pragma comment(lib, "synchronization.lib")    // WaitOnAddress
 
 // Helper macro for HRESULT checking and logging
 #define CHECK_HR_AND_FAIL(hr, msg) \
@@ -21,9 +42,3202 @@
         return false; \
     }
 
+//
+// Diagnostics builds (-DBACKUP_COUNT_ALLOCATIONS) count every heap allocation in the
+// process so the run report can show what a copied file costs; the copy path is meant
+// to allocate nothing once it is warmed up. Release builds keep the default allocator.
+//
+#ifdef BACKUP_COUNT_ALLOCATIONS
+std::atomic<ULONGLONG> heapAllocations{ 0 };
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = malloc(size ? size : 1)) {
+        return block;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    free(block);
+}
+#endif
+
+//
+// BlockingQueue is a bounded multi-producer/multi-consumer FIFO used to hand work
+// between the scanner, reader and writer stages. It is Dmitry Vyukov's lock-free ring:
+// each slot carries a sequence number that tells producers and consumers whose turn
+// it is, so an uncontended Push/Pop costs one CAS, a fence and a read of the other
+// side's waiter count, and takes no lock. The two position counters sit on separate
+// cache lines so producers and consumers do not false-share.
+//
+// Push() blocks while the queue is full and Pop() while it is empty (after a short
+// spin) by sleeping on a signal word with WaitOnAddress. Single-item Push/Pop wake one
+// sleeper with WakeByAddressSingle, and only when a sleeper has no wake-up on its way;
+// the batch calls and Close() wake them all. Pop() returns false once the queue is
+// closed and drained.
+//
+template <typename T>
+class BlockingQueue {
+private:
+    static constexpr size_t kCacheLine = 64;
+    static constexpr int kSpins = 64;
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // Where blocked threads sleep. 'state' packs the number of registered waiters (high
+    // half) and the number of wake-ups sent to them and not yet used (low half). A wake-up
+    // is only sent when there are more waiters than wake-ups in flight, so a consumer
+    // draining a full queue makes one system call for the producer it unblocks, not one
+    // per item. Every waiter uses up one wake-up, if any are left, when it unregisters.
+    struct alignas(kCacheLine) Signal {
+        static constexpr ULONGLONG kWaiter = 1ULL << 32;
+        static constexpr ULONGLONG kWakeMask = kWaiter - 1;
+
+        std::atomic<ULONGLONG> generation{ 0 };     // bumped before every wake-up; slept on
+        std::atomic<ULONGLONG> state{ 0 };
+
+        void Register() {
+            state.fetch_add(kWaiter);
+        }
+
+        void Unregister() {
+            ULONGLONG current = state.load();
+            while (!state.compare_exchange_weak(current, current - kWaiter - ((current & kWakeMask) ? 1 : 0))) {
+            }
+        }
+
+        // Wakes one sleeper that has no wake-up on its way yet, if there is one.
+        void NotifyOne() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            ULONGLONG current = state.load();
+            while ((current >> 32) > (current & kWakeMask)) {
+                if (state.compare_exchange_weak(current, current + 1)) {
+                    generation.fetch_add(1);
+                    WakeByAddressSingle(&generation);
+                    return;
+                }
+            }
+        }
+
+        void NotifyAll() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            ULONGLONG current = state.load();
+            while ((current >> 32) > (current & kWakeMask)) {
+                if (state.compare_exchange_weak(current, (current & ~kWakeMask) | (current >> 32))) {
+                    generation.fetch_add(1);
+                    WakeByAddressAll(&generation);
+                    return;
+                }
+            }
+        }
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(kCacheLine) std::atomic<size_t> enqueuePos{ 0 };
+    alignas(kCacheLine) std::atomic<size_t> dequeuePos{ 0 };
+    Signal notEmpty;
+    Signal notFull;
+    std::atomic<bool> closed{ false };
+
+    static size_t RoundUpToPowerOfTwo(size_t value) {
+        size_t size = 2;
+        while (size < value) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    // Spins briefly, then sleeps on 'signal' until 'ready' holds. Returns false if the
+    // queue was closed first.
+    template <typename Ready>
+    bool WaitFor(Signal& signal, Ready ready) {
+        for (int spin = 0; spin < kSpins; ++spin) {
+            if (ready()) {
+                return true;
+            }
+            YieldProcessor();
+        }
+        for (;;) {
+            // Registering before the last look at the queue pairs with the fence in
+            // Notify*: either this thread sees the item, or the notifier sees this thread
+            // and bumps the generation, so WaitOnAddress returns at once.
+            signal.Register();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            ULONGLONG seen = signal.generation.load();
+            bool done = ready();
+            if (!done && !closed.load()) {
+                WaitOnAddress(&signal.generation, &seen, sizeof(seen), INFINITE);
+            }
+            signal.Unregister();
+            if (done) {
+                return true;
+            }
+            if (closed.load()) {
+                return ready();
+            }
+        }
+    }
+
+public:
+    explicit BlockingQueue(size_t maxItems)
+        : cells(new Cell[RoundUpToPowerOfTwo(maxItems)]), mask(RoundUpToPowerOfTwo(maxItems) - 1) {
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BlockingQueue(const BlockingQueue&) = delete;
+    BlockingQueue& operator=(const BlockingQueue&) = delete;
+
+    // Non-blocking; leaves 'item' untouched and returns false when the queue is full.
+    bool TryPush(T& item) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(item);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Non-blocking; returns false when the queue is empty.
+    bool TryPop(T& out) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(cell.value);
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Blocks while the queue is full. Items pushed after Close() are dropped.
+    void Push(T item) {
+        if (WaitFor(notFull, [&] { return TryPush(item); })) {
+            notEmpty.NotifyOne();
+        }
+    }
+
+    // Pushes every item, blocking whenever the queue is full.
+    void PushBatch(std::vector<T>& items) {
+        if (items.empty()) {
+            return;
+        }
+        for (T& item : items) {
+            if (!TryPush(item)) {
+                notEmpty.NotifyAll();
+                if (!WaitFor(notFull, [&] { return TryPush(item); })) {
+                    break;
+                }
+            }
+        }
+        notEmpty.NotifyAll();
+        items.clear();
+    }
+
+    bool Pop(T& out) {
+        if (!WaitFor(notEmpty, [&] { return TryPop(out); })) {
+            return false;
+        }
+        notFull.NotifyOne();
+        return true;
+    }
+
+    // Blocks for the first item only, then takes up to maxItems - 1 more that are
+    // already queued. Returns the number of items stored in 'out' (0 = closed and drained).
+    size_t PopBatch(T* out, size_t maxItems) {
+        if (!WaitFor(notEmpty, [&] { return TryPop(out[0]); })) {
+            return 0;
+        }
+        size_t count = 1;
+        while (count < maxItems && TryPop(out[count])) {
+            ++count;
+        }
+        if (count == 1) {
+            notFull.NotifyOne();
+        }
+        else {
+            notFull.NotifyAll();
+        }
+        return count;
+    }
+
+    // Wakes every sleeper unconditionally: one whose wake-up is still on its way has
+    // not necessarily seen 'closed' yet.
+    void Close() {
+        closed.store(true);
+        for (Signal* signal : { &notEmpty, &notFull }) {
+            signal->generation.fetch_add(1);
+            WakeByAddressAll(&signal->generation);
+        }
+    }
+};
+
+//
+// EnableLockMemoryPrivilege turns on SeLockMemoryPrivilege in the process token, which
+// large-page allocations need. It only succeeds if the account holds the "Lock pages in
+// memory" right, which administrators do not have by default.
+//
+static bool EnableLockMemoryPrivilege() {
+    HANDLE token = NULL;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token)) {
+        return false;
+    }
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+        GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+    CloseHandle(token);
+    return enabled;
+}
+
+//
+// BufferPool hands out fixed-size I/O buffers carved from one page-aligned allocation,
+// so they satisfy the sector alignment FILE_FLAG_NO_BUFFERING requires. Readers block
+// in Acquire() when every buffer is queued at a writer, which bounds memory use.
+// On request the region is backed by large pages (2 MB on x64), so the whole pool
+// needs a few dozen TLB entries instead of one per 4 KB; if they cannot be had, it
+// quietly falls back to normal pages.
+//
+class BufferPool {
+private:
+    BYTE* region = nullptr;
+    BlockingQueue<BYTE*> freeBuffers;
+    DWORD bufferSize;
+    bool onLargePages = false;
+
+public:
+    BufferPool(size_t count, DWORD size, bool largePages = false) : freeBuffers(count), bufferSize(size) {
+        SIZE_T largePage = largePages ? GetLargePageMinimum() : 0;
+        if (largePage && EnableLockMemoryPrivilege()) {
+            SIZE_T bytes = (count * size + largePage - 1) / largePage * largePage;
+            region = static_cast<BYTE*>(VirtualAlloc(NULL, bytes, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                PAGE_READWRITE));
+            onLargePages = region != nullptr;
+        }
+        if (!region) {
+            region = static_cast<BYTE*>(VirtualAlloc(NULL, count * size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+        }
+        if (!region) {
+            throw std::bad_alloc();
+        }
+        for (size_t i = 0; i < count; ++i) {
+            freeBuffers.Push(region + i * size);
+        }
+    }
+
+    ~BufferPool() {
+        VirtualFree(region, 0, MEM_RELEASE);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    BYTE* Acquire() {
+        BYTE* buffer = nullptr;
+        freeBuffers.Pop(buffer);
+        return buffer;
+    }
+
+    void Release(BYTE* buffer) {
+        freeBuffers.Push(buffer);
+    }
+
+    DWORD BufferSize() const {
+        return bufferSize;
+    }
+
+    bool UsesLargePages() const {
+        return onLargePages;
+    }
+};
+
+//
+// WorkerGate limits how many threads of a fixed-size pool may take new work. Threads
+// whose index is at or above the active count park in WaitUntilActive() until the
+// limit is raised or the gate is opened for shutdown.
+//
+class WorkerGate {
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t active;
+    bool open = false;
+
+public:
+    explicit WorkerGate(size_t initial) : active(initial) {
+    }
+
+    void WaitUntilActive(size_t index) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this, index] { return index < active || open; });
+    }
+
+    size_t Active() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return active;
+    }
+
+    void SetActive(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        active = count;
+        changed.notify_all();
+    }
+
+    // Releases every parked thread so it can observe a closed queue and exit.
+    void Open() {
+        std::lock_guard<std::mutex> lock(mutex);
+        open = true;
+        changed.notify_all();
+    }
+};
+
+//
+// WorkStealingDeque is a Chase-Lev deque of task pointers. The owning worker pushes and
+// pops at the bottom (newest first, for cache locality); other workers steal from the
+// top (oldest first, which for recursive work like a directory walk are the biggest
+// pieces). Arrays outgrown by Push() stay allocated until the deque is destroyed,
+// because a thief may still be reading from one.
+//
+template <typename T>
+class WorkStealingDeque {
+private:
+    struct Array {
+        explicit Array(size_t size) : capacity(size), slots(new std::atomic<T*>[size]) {
+        }
+
+        T* Get(int64_t index) const {
+            return slots[static_cast<size_t>(index) & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        void Put(int64_t index, T* item) {
+            slots[static_cast<size_t>(index) & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+
+        size_t capacity;    // power of two
+        std::unique_ptr<std::atomic<T*>[]> slots;
+    };
+
+    std::atomic<int64_t> top{ 0 };
+    std::atomic<int64_t> bottom{ 0 };
+    std::atomic<Array*> array;
+    std::vector<std::unique_ptr<Array>> arrays;         // owner only
+
+public:
+    WorkStealingDeque() {
+        arrays.push_back(std::make_unique<Array>(256));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only.
+    void Push(T* item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Array* a = array.load(std::memory_order_relaxed);
+        if (b - t >= static_cast<int64_t>(a->capacity)) {
+            arrays.push_back(std::make_unique<Array>(a->capacity * 2));
+            Array* grown = arrays.back().get();
+            for (int64_t i = t; i < b; ++i) {
+                grown->Put(i, a->Get(i));
+            }
+            array.store(grown, std::memory_order_release);
+            a = grown;
+        }
+        a->Put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only. Returns nullptr when empty.
+    T* Pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* item = a->Get(b);
+        if (t == b) {
+            // Last item: race the thieves for it.
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Any thread. Returns nullptr when empty or when another thread won the race.
+    T* Steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        T* item = array.load(std::memory_order_acquire)->Get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    size_t Size() const {
+        int64_t size = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+        return size > 0 ? static_cast<size_t>(size) : 0;
+    }
+};
+
+//
+// TaskGroup counts the tasks of one batch so the submitter can wait for all of them.
+//
+class TaskGroup {
+private:
+    std::atomic<size_t> pending{ 0 };
+    std::mutex mutex;
+    std::condition_variable finished;
+
+public:
+    void Add() {
+        pending++;
+    }
+
+    // Decrements and notifies under one lock: once Wait() sees zero it may return and
+    // destroy the group.
+    void Done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) {
+            finished.notify_all();
+        }
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return pending == 0; });
+    }
+};
+
+//
+// TaskScheduler is the one worker pool that the backup's CPU-side stages (directory
+// scanning, directory metadata) submit to, instead of each bringing its own threads.
+// Every worker owns a WorkStealingDeque per priority; tasks submitted from a worker go
+// to its own deque, others to a shared injection queue. A worker looks for High
+// priority work (its own, then stolen, then injected) before Normal work.
+//
+// At most 'target' workers (one per logical processor) run tasks at a time. A task
+// about to block on I/O declares it with a BlockingScope, which hands its slot to
+// another worker, waking an idle one or starting a new one up to kMaxWorkers, so that
+// blocked tasks do not leave the CPUs idle while work is queued.
+//
+class TaskScheduler {
+public:
+    enum Priority {
+        High,       // metadata
+        Normal,     // bulk work
+        PriorityCount
+    };
+
+    struct Stats {
+        ULONGLONG tasksRun[PriorityCount] = {};
+        ULONGLONG steals = 0;
+        ULONGLONG blockingScopes = 0;
+        size_t workers = 0;
+        size_t peakQueued = 0;
+        size_t queued = 0;
+        double idleSeconds = 0;
+    };
+
+private:
+    static constexpr size_t kMaxWorkers = 64;
+
+    struct Task {
+        std::function<void()> run;
+        TaskGroup* group;
+        Priority priority;
+    };
+
+    struct Worker {
+        size_t index = 0;
+        WorkStealingDeque<Task> deques[PriorityCount];
+        std::thread thread;
+        ULONGLONG stealSeed = 0;
+    };
+
+    // Thread-local, so there must be only one scheduler; see Scheduler().
+    static thread_local Worker* localWorker;
+
+    const size_t target;
+    std::atomic<Worker*> workers[kMaxWorkers] = {};
+    std::atomic<size_t> workerCount{ 0 };
+    std::mutex spawnMutex;
+    std::deque<Task*> injected[PriorityCount];          // guarded by injectedMutex
+    std::mutex injectedMutex;
+    std::atomic<size_t> queued{ 0 };
+    std::atomic<size_t> running{ 0 };
+    std::atomic<size_t> idle{ 0 };
+    std::atomic<size_t> blocked{ 0 };                   // workers inside a BlockingScope
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;                              // guarded by sleepMutex
+
+    std::atomic<ULONGLONG> tasksRun[PriorityCount] = {};
+    std::atomic<ULONGLONG> steals{ 0 };
+    std::atomic<ULONGLONG> blockingScopes{ 0 };
+    std::atomic<ULONGLONG> idleMicros{ 0 };
+    std::atomic<size_t> peakQueued{ 0 };
+
+    void SpawnWorker() {
+        std::lock_guard<std::mutex> lock(spawnMutex);
+        size_t index = workerCount.load();
+        if (index == kMaxWorkers) {
+            return;
+        }
+        Worker* worker = new Worker();
+        worker->index = index;
+        worker->stealSeed = index;
+        workers[index].store(worker);
+        workerCount.store(index + 1);
+        worker->thread = std::thread([this, worker] { WorkerLoop(*worker); });
+    }
+
+    // Gets queued work going: wakes an idle worker, or starts one when every existing
+    // worker is busy or blocked and a run slot is free. A worker that has just found
+    // nothing to do is briefly neither running nor idle; the worker count check keeps
+    // that window from spawning extra threads, and the worker itself re-checks for
+    // queued work before it sleeps.
+    void WakeOne() {
+        if (queued.load() == 0) {
+            return;
+        }
+        if (idle.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wake.notify_one();
+        }
+        else if (running.load() < target && workerCount.load() < target + blocked.load()) {
+            SpawnWorker();
+        }
+    }
+
+    Task* TakeInjected(Priority priority) {
+        std::lock_guard<std::mutex> lock(injectedMutex);
+        if (injected[priority].empty()) {
+            return nullptr;
+        }
+        Task* task = injected[priority].front();
+        injected[priority].pop_front();
+        return task;
+    }
+
+    Task* FindTask(Worker& self) {
+        size_t count = workerCount.load();
+        for (int p = 0; p < PriorityCount; ++p) {
+            Priority priority = static_cast<Priority>(p);
+            if (Task* task = self.deques[priority].Pop()) {
+                return task;
+            }
+            // Start stealing at a different victim each time so thieves spread out.
+            size_t start = static_cast<size_t>(self.stealSeed++);
+            for (size_t i = 0; i < count; ++i) {
+                Worker* victim = workers[(start + i) % count].load();
+                if (victim != &self) {
+                    if (Task* task = victim->deques[priority].Steal()) {
+                        steals++;
+                        return task;
+                    }
+                }
+            }
+            if (Task* task = TakeInjected(priority)) {
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void Execute(Task* task) {
+        task->run();
+        tasksRun[task->priority]++;
+        if (task->group) {
+            task->group->Done();
+        }
+        delete task;
+    }
+
+    void WorkerLoop(Worker& self) {
+        localWorker = &self;
+        for (;;) {
+            if (running.fetch_add(1) < target) {
+                Task* task = FindTask(self);
+                if (task) {
+                    queued--;
+                    Execute(task);
+                    running--;
+                    continue;
+                }
+            }
+            running--;
+
+            auto start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            idle++;
+            wake.wait(lock, [this] { return stopping || (queued.load() > 0 && running.load() < target); });
+            idle--;
+            idleMicros += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            if (stopping && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    TaskScheduler() : target((std::max)(2u, std::thread::hardware_concurrency())) {
+    }
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        // Join them all before freeing any: a worker still running may steal from the others.
+        for (size_t i = 0; i < workerCount.load(); ++i) {
+            workers[i].load()->thread.join();
+        }
+        for (size_t i = 0; i < workerCount.load(); ++i) {
+            delete workers[i].load();
+        }
+    }
+
+    // Queues fn; 'group', if given, is counted until fn has run.
+    void Submit(Priority priority, std::function<void()> fn, TaskGroup* group = nullptr) {
+        if (group) {
+            group->Add();
+        }
+        Task* task = new Task{ std::move(fn), group, priority };
+        // Counted before it is visible: a thief may run it, and decrement, straight away.
+        size_t now = ++queued;
+        size_t peak = peakQueued.load(std::memory_order_relaxed);
+        while (now > peak && !peakQueued.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+        }
+        if (localWorker) {
+            localWorker->deques[priority].Push(task);
+        }
+        else {
+            std::lock_guard<std::mutex> lock(injectedMutex);
+            injected[priority].push_back(task);
+        }
+        WakeOne();
+    }
+
+    // Called by BlockingScope around a blocking call made from a task.
+    void BeginBlocking() {
+        if (localWorker) {
+            blockingScopes++;
+            blocked++;
+            running--;
+            WakeOne();
+        }
+    }
+
+    void EndBlocking() {
+        if (localWorker) {
+            running++;
+            blocked--;
+        }
+    }
+
+    Stats Snapshot() {
+        Stats stats;
+        for (int p = 0; p < PriorityCount; ++p) {
+            stats.tasksRun[p] = tasksRun[p];
+        }
+        stats.steals = steals;
+        stats.blockingScopes = blockingScopes;
+        stats.workers = workerCount;
+        stats.peakQueued = peakQueued;
+        stats.queued = queued;
+        stats.idleSeconds = idleMicros / 1e6;
+        return stats;
+    }
+};
+
+thread_local TaskScheduler::Worker* TaskScheduler::localWorker = nullptr;
+
+// The process-wide scheduler.
+TaskScheduler& Scheduler() {
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+//
+// BlockingScope marks a stretch of a task that waits on I/O or a full queue, so the
+// scheduler can run other work on the CPU meanwhile. Outside a task it does nothing.
+//
+class BlockingScope {
+public:
+    BlockingScope() {
+        Scheduler().BeginBlocking();
+    }
+
+    ~BlockingScope() {
+        Scheduler().EndBlocking();
+    }
+
+    BlockingScope(const BlockingScope&) = delete;
+    BlockingScope& operator=(const BlockingScope&) = delete;
+};
+
+//
+// AdaptiveConcurrency hill-climbs the active worker count of each pipeline stage
+// (concurrent directory listings, and the readers or writers of each device) toward
+// the knee of the throughput curve. It alternates between a baseline window and a
+// trial window in which one stage has one worker more (or fewer). A step up is
+// kept only if it gains at least kKneeGain throughput; a step down is kept unless it
+// loses that much. The stages are tuned round-robin for as long as the run lasts.
+//
+class AdaptiveConcurrency {
+public:
+    struct Knob {
+        std::wstring name;
+        WorkerGate* gate;
+        size_t minimum;
+        size_t maximum;
+        int direction = +1;
+    };
+
+    struct Sample {
+        double seconds;
+        std::vector<size_t> workers;
+        double mbPerSec;
+        double latencyMs;
+    };
+
+private:
+    static constexpr auto kWindow = std::chrono::milliseconds(1000);
+    static constexpr double kKneeGain = 0.05;
+
+    std::vector<Knob> knobs;
+    const std::atomic<ULONGLONG>& completedBytes;
+    const std::atomic<ULONGLONG>& ioCount;
+    const std::atomic<ULONGLONG>& ioMicros;
+    std::vector<Sample> trajectory;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stopRequested;
+    bool stopping = false;
+
+    void Record(double seconds, double mbPerSec, double latencyMs) {
+        Sample sample{ seconds, {}, mbPerSec, latencyMs };
+        for (Knob& knob : knobs) {
+            sample.workers.push_back(knob.gate->Active());
+        }
+        trajectory.push_back(std::move(sample));
+    }
+
+    // Moves the knob one step in its direction, reversing once if it is at a limit.
+    bool Step(Knob& knob) {
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            size_t current = knob.gate->Active();
+            if (knob.direction > 0 ? current < knob.maximum : current > knob.minimum) {
+                knob.gate->SetActive(current + knob.direction);
+                return true;
+            }
+            knob.direction = -knob.direction;
+        }
+        return false;
+    }
+
+    void ControlLoop() {
+        auto start = std::chrono::steady_clock::now();
+        auto windowStart = start;
+        ULONGLONG lastBytes = completedBytes;
+        ULONGLONG lastCount = ioCount;
+        ULONGLONG lastMicros = ioMicros;
+        double baseline = 0;
+        size_t current = 0;
+        bool trialRunning = false;
+        // Scanners may add knobs at any time, so even the first sample is taken locked.
+        std::unique_lock<std::mutex> lock(mutex);
+        Record(0, 0, 0);
+
+        while (!stopRequested.wait_for(lock, kWindow, [this] { return stopping; })) {
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - windowStart).count();
+            ULONGLONG bytes = completedBytes;
+            ULONGLONG count = ioCount;
+            ULONGLONG micros = ioMicros;
+            double throughput = (bytes - lastBytes) / seconds;
+            double latencyMs = count > lastCount ? (micros - lastMicros) / 1000.0 / (count - lastCount) : 0;
+            windowStart = now;
+            lastBytes = bytes;
+            lastCount = count;
+            lastMicros = micros;
+
+            current %= knobs.size();
+            Knob& knob = knobs[current];
+            if (trialRunning) {
+                double gain = baseline > 0 ? (throughput - baseline) / baseline : 0;
+                bool keep = knob.direction > 0 ? gain >= kKneeGain : gain > -kKneeGain;
+                if (keep) {
+                    Record(std::chrono::duration<double>(now - start).count(), throughput / (1024 * 1024), latencyMs);
+                }
+                else {
+                    knob.gate->SetActive(knob.gate->Active() - knob.direction);
+                    knob.direction = -knob.direction;
+                }
+                current = (current + 1) % knobs.size();
+                trialRunning = false;
+            }
+            else if (throughput > 0) {
+                // Idle windows (e.g. the writer draining one huge file) say nothing about the knee.
+                baseline = throughput;
+                trialRunning = Step(knob);
+                if (!trialRunning) {
+                    current = (current + 1) % knobs.size();
+                }
+            }
+        }
+    }
+
+public:
+    AdaptiveConcurrency(std::vector<Knob> stageKnobs, const std::atomic<ULONGLONG>& bytes,
+        const std::atomic<ULONGLONG>& operations, const std::atomic<ULONGLONG>& operationMicros)
+        : knobs(std::move(stageKnobs)), completedBytes(bytes), ioCount(operations), ioMicros(operationMicros) {
+    }
+
+    void Start() {
+        thread = std::thread([this] { ControlLoop(); });
+    }
+
+    // Adds a stage discovered after the run started, e.g. the reader pool of a newly
+    // reached source device. Samples recorded before it simply have fewer entries.
+    void AddKnob(Knob knob) {
+        std::lock_guard<std::mutex> lock(mutex);
+        knobs.push_back(std::move(knob));
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        stopRequested.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    const std::vector<Knob>& Knobs() const {
+        return knobs;
+    }
+
+    const std::vector<Sample>& Trajectory() const {
+        return trajectory;
+    }
+};
+
+//
+// BinaryLog takes diagnostics off the copy threads. Each thread appends fixed-format
+// binary records (counter, event, error code, path) to its own lock-free ring buffer,
+// which costs a QueryPerformanceCounter call and a memcpy; a background thread drains
+// the rings every few milliseconds into the log file and echoes the records to the
+// console. Records are dropped (and counted) rather than blocking when a ring is full.
+// The file is turned back into text with --decode-log.
+//
+class BinaryLog {
+public:
+    enum Event : WORD {
+        ListFailed,
+        CreateDirectoryFailed,
+        OpenFailed,
+        ReadFailed,
+        CreateFailed,
+        WriteFailed,
+        SetSizeFailed,
+        FreeSpaceFailed,
+        // Notices rather than errors from here on; echoed to stdout.
+        MountPointFollowed,
+        MountPointSkipped,
+        MountPointNotFollowed,
+        EventCount
+    };
+
+private:
+    static constexpr size_t kRingBytes = 64 * 1024;     // power of two
+    static constexpr size_t kMaxPathChars = 4096;
+    static constexpr std::chrono::milliseconds kDrainInterval{ 20 };
+    static constexpr char kMagic[8] = "BKLOG01";
+
+    struct FileHeader {
+        char magic[8];
+        ULONGLONG frequency;
+        ULONGLONG startCounter;
+    };
+
+    // Precedes the bytes drained from one thread's ring.
+    struct ChunkHeader {
+        DWORD threadId;
+        DWORD bytes;
+        DWORD dropped;
+        DWORD reserved;
+    };
+
+    // Followed by 'chars' UTF-16 code units of path.
+    struct RecordHeader {
+        ULONGLONG counter;
+        DWORD code;
+        WORD event;
+        WORD chars;
+    };
+
+    // Single producer (the owning thread) and single consumer (the drain thread). The
+    // positions only ever grow; the byte offset is the position modulo kRingBytes.
+    struct Ring {
+        DWORD threadId = 0;
+        std::atomic<size_t> head{ 0 };
+        std::atomic<size_t> tail{ 0 };
+        std::atomic<DWORD> dropped{ 0 };
+        char data[kRingBytes];
+    };
+
+    std::vector<std::unique_ptr<Ring>> rings;           // guarded by ringsMutex
+    std::mutex ringsMutex;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    ULONGLONG frequency = 0;
+    ULONGLONG startCounter = 0;
+    std::thread drainThread;
+    std::mutex consumeMutex;                            // one consumer at a time
+    std::mutex drainMutex;
+    std::condition_variable drainWake;
+    bool stopping = false;                              // guarded by drainMutex
+
+    static ULONGLONG Counter() {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return static_cast<ULONGLONG>(now.QuadPart);
+    }
+
+    Ring* LocalRing() {
+        thread_local Ring* ring = nullptr;
+        if (!ring) {
+            auto created = std::make_unique<Ring>();
+            created->threadId = GetCurrentThreadId();
+            ring = created.get();
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            rings.push_back(std::move(created));
+        }
+        return ring;
+    }
+
+    static void CopyIn(Ring& ring, size_t position, const void* source, size_t length) {
+        size_t offset = position & (kRingBytes - 1);
+        size_t first = (std::min)(length, kRingBytes - offset);
+        memcpy(ring.data + offset, source, first);
+        memcpy(ring.data, static_cast<const char*>(source) + first, length - first);
+    }
+
+    static void CopyOut(const Ring& ring, size_t position, char* target, size_t length) {
+        size_t offset = position & (kRingBytes - 1);
+        size_t first = (std::min)(length, kRingBytes - offset);
+        memcpy(target, ring.data + offset, first);
+        memcpy(target + first, ring.data, length - first);
+    }
+
+    // Moves everything the rings hold into the file and onto the console.
+    void Drain() {
+        std::lock_guard<std::mutex> consume(consumeMutex);
+        std::vector<Ring*> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            for (auto& ring : rings) {
+                snapshot.push_back(ring.get());
+            }
+        }
+        std::vector<char> chunk;
+        for (Ring* ring : snapshot) {
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            DWORD dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (head == tail && dropped == 0) {
+                continue;
+            }
+            ChunkHeader header = { ring->threadId, static_cast<DWORD>(head - tail), dropped, 0 };
+            chunk.resize(sizeof(header) + header.bytes);
+            memcpy(chunk.data(), &header, sizeof(header));
+            CopyOut(*ring, tail, chunk.data() + sizeof(header), header.bytes);
+            ring->tail.store(head, std::memory_order_release);
+
+            if (file != INVALID_HANDLE_VALUE) {
+                DWORD written = 0;
+                WriteFile(file, chunk.data(), static_cast<DWORD>(chunk.size()), &written, NULL);
+            }
+            ForEachRecord(chunk.data() + sizeof(header), header.bytes,
+                [](const RecordHeader& record, const wchar_t* path) {
+                    (record.event >= MountPointFollowed ? std::wcout : std::wcerr) << Format(record, path) << L"\n";
+                });
+            if (dropped) {
+                std::wcerr << dropped << L" log records dropped on thread " << ring->threadId << L"\n";
+            }
+        }
+    }
+
+    void DrainLoop() {
+        std::unique_lock<std::mutex> lock(drainMutex);
+        while (!stopping) {
+            drainWake.wait_for(lock, kDrainInterval);
+            lock.unlock();
+            Drain();
+            lock.lock();
+        }
+    }
+
+    template <typename Visit>
+    static bool ForEachRecord(const char* data, size_t length, Visit visit) {
+        std::wstring path;
+        size_t pos = 0;
+        while (pos + sizeof(RecordHeader) <= length) {
+            RecordHeader record;
+            memcpy(&record, data + pos, sizeof(record));
+            pos += sizeof(record);
+            if (record.event >= EventCount || pos + record.chars * sizeof(wchar_t) > length) {
+                return false;
+            }
+            path.resize(record.chars);
+            memcpy(&path[0], data + pos, record.chars * sizeof(wchar_t));
+            pos += record.chars * sizeof(wchar_t);
+            visit(record, path.c_str());
+        }
+        return pos == length;
+    }
+
+    static std::wstring Format(const RecordHeader& record, const wchar_t* path) {
+        static const wchar_t* const kText[EventCount] = {
+            L"Failed to list",
+            L"Failed to create directory",
+            L"Failed to open",
+            L"Failed to read",
+            L"Failed to create",
+            L"Failed to write",
+            L"Failed to set the size of",
+            L"Failed to query free space on",
+            L"Following mount point",
+            L"Not following mount point",
+            L"Not following mount point",
+        };
+        std::wstring line = std::wstring(kText[record.event]) + L" " + path;
+        if (record.event == MountPointFollowed) {
+            return line + L" (not part of the snapshot; copied live)";
+        }
+        if (record.event == MountPointSkipped) {
+            return line + L" (it leads to a backup destination)";
+        }
+        if (record.event == MountPointNotFollowed) {
+            return line + L" (another volume, not in the snapshot; see --follow-mounts)";
+        }
+        wchar_t code[32];
+        swprintf(code, 32, L" (error=0x%lx)", static_cast<unsigned long>(record.code));
+        return line + code;
+    }
+
+public:
+    ~BinaryLog() {
+        Stop();
+    }
+
+    // Starts the drain thread. Records are still echoed to the console when the log file
+    // cannot be created.
+    void Start(const std::filesystem::path& path) {
+        LARGE_INTEGER value;
+        QueryPerformanceFrequency(&value);
+        frequency = static_cast<ULONGLONG>(value.QuadPart);
+        startCounter = Counter();
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            std::wcerr << L"Failed to create log file " << path.wstring() << L" (error=0x" << std::hex
+                << GetLastError() << std::dec << L")\n";
+        }
+        else {
+            FileHeader header = {};
+            memcpy(header.magic, kMagic, sizeof(header.magic));
+            header.frequency = frequency;
+            header.startCounter = startCounter;
+            DWORD written = 0;
+            WriteFile(file, &header, sizeof(header), &written, NULL);
+        }
+        drainThread = std::thread([this] { DrainLoop(); });
+    }
+
+    // Drains whatever is left and closes the file.
+    void Stop() {
+        if (!drainThread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(drainMutex);
+            stopping = true;
+        }
+        drainWake.notify_one();
+        drainThread.join();
+        Drain();
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // Writes out what has been logged so far, e.g. before printing a summary below it.
+    void Flush() {
+        Drain();
+    }
+
+    // Hot path: never blocks and never touches a stream.
+    void Write(Event event, const std::wstring& path, DWORD code = 0) {
+        Ring& ring = *LocalRing();
+        RecordHeader record = { Counter(), code, event, static_cast<WORD>((std::min)(path.size(), kMaxPathChars)) };
+        size_t pathBytes = record.chars * sizeof(wchar_t);
+        size_t head = ring.head.load(std::memory_order_relaxed);
+        if (sizeof(record) + pathBytes > kRingBytes - (head - ring.tail.load(std::memory_order_acquire))) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        CopyIn(ring, head, &record, sizeof(record));
+        CopyIn(ring, head + sizeof(record), path.data(), pathBytes);
+        ring.head.store(head + sizeof(record) + pathBytes, std::memory_order_release);
+    }
+
+    // Prints a log file as text, ordered by time across threads. Returns the process exit code.
+    static int Decode(const std::filesystem::path& path) {
+        std::ifstream in(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        FileHeader header;
+        if (data.size() < sizeof(header) || memcmp(data.data(), kMagic, sizeof(kMagic)) != 0) {
+            std::wcerr << L"Not a backup log: " << path.wstring() << L"\n";
+            return 2;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+
+        struct Line {
+            ULONGLONG counter;
+            DWORD threadId;
+            std::wstring text;
+        };
+        std::vector<Line> lines;
+        size_t pos = sizeof(header);
+        bool intact = true;
+        while (intact && pos + sizeof(ChunkHeader) <= data.size()) {
+            ChunkHeader chunk;
+            memcpy(&chunk, data.data() + pos, sizeof(chunk));
+            pos += sizeof(chunk);
+            if (chunk.bytes > data.size() - pos) {
+                intact = false;
+                break;
+            }
+            intact = ForEachRecord(data.data() + pos, chunk.bytes, [&](const RecordHeader& record, const wchar_t* text) {
+                lines.push_back({ record.counter, chunk.threadId, Format(record, text) });
+            });
+            if (chunk.dropped) {
+                lines.push_back({ lines.empty() ? header.startCounter : lines.back().counter, chunk.threadId,
+                    std::to_wstring(chunk.dropped) + L" records dropped" });
+            }
+            pos += chunk.bytes;
+        }
+        std::stable_sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) {
+            return a.counter < b.counter;
+        });
+        for (const Line& line : lines) {
+            double seconds = header.frequency ? static_cast<double>(line.counter - header.startCounter) / header.frequency : 0;
+            wchar_t prefix[64];
+            swprintf(prefix, 64, L"%12.6f [%5lu] ", seconds, static_cast<unsigned long>(line.threadId));
+            std::wcout << prefix << line.text << L"\n";
+        }
+        if (!intact || pos != data.size()) {
+            std::wcerr << L"Log is truncated or damaged after " << lines.size() << L" records.\n";
+            return 2;
+        }
+        return 0;
+    }
+};
+
+// The process-wide log; started and stopped by wmain.
+BinaryLog& Log() {
+    static BinaryLog log;
+    return log;
+}
+
+//
+// SlowFileTracker keeps the N slowest file copies of a run in a min-heap, with the
+// phase each one spent most of its time in. A file faster than the current N-th
+// slowest is turned away by one relaxed atomic load, so the per-file cost is negligible.
+//
+class SlowFileTracker {
+public:
+    struct Entry {
+        double seconds;
+        std::wstring path;
+        ULONGLONG size;
+        const wchar_t* stalledPhase;
+        double phaseSeconds;
+    };
+
+private:
+    size_t capacity;
+    std::mutex mutex;
+    std::vector<Entry> heap;
+    std::atomic<double> threshold{ 0 };
+
+    static bool Slower(const Entry& a, const Entry& b) {
+        return a.seconds > b.seconds;
+    }
+
+public:
+    explicit SlowFileTracker(size_t count) : capacity(count) {
+    }
+
+    void Offer(double seconds, const std::wstring& path, ULONGLONG size,
+        const wchar_t* stalledPhase, double phaseSeconds) {
+        if (seconds <= threshold.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (heap.size() == capacity) {
+            if (seconds <= heap.front().seconds) {
+                return;
+            }
+            std::pop_heap(heap.begin(), heap.end(), Slower);
+            heap.pop_back();
+        }
+        heap.push_back(Entry{ seconds, path, size, stalledPhase, phaseSeconds });
+        std::push_heap(heap.begin(), heap.end(), Slower);
+        if (heap.size() == capacity) {
+            threshold.store(heap.front().seconds, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the tracked files, slowest first.
+    std::vector<Entry> Slowest() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Entry> sorted = heap;
+        std::sort(sorted.begin(), sorted.end(), Slower);
+        return sorted;
+    }
+};
+
+//
+// DeviceProfile describes the behaviour a SimulatedDevice imposes on the I/O of a real
+// device: fixed latency plus random jitter per request, a bandwidth cap shared by every
+// request to the device, and a rate of transient failures. Those fail with
+// ERROR_IO_DEVICE, which the copy engine retries a few times before giving up on a file.
+//
+struct DeviceProfile {
+    std::wstring name;
+    double latencyMs = 0;
+    double jitterMs = 0;
+    double megabytesPerSec = 0;     // 0 = no cap
+    double errorPercent = 0;
+
+    bool Enabled() const {
+        return latencyMs > 0 || jitterMs > 0 || megabytesPerSec > 0 || errorPercent > 0;
+    }
+};
+
+// Accepts a named profile ("usb", "san", "flaky") or a custom
+// "latency_ms:jitter_ms:mb_per_sec:error_percent" specification.
+bool ParseDeviceProfile(const std::wstring& spec, DeviceProfile& profile) {
+    if (spec == L"usb") {
+        profile = DeviceProfile{ spec, 1, 2, 30, 0 };
+        return true;
+    }
+    if (spec == L"san") {
+        profile = DeviceProfile{ spec, 5, 10, 100, 0 };
+        return true;
+    }
+    if (spec == L"flaky") {
+        profile = DeviceProfile{ spec, 0.2, 1, 0, 1 };
+        return true;
+    }
+    double values[4] = {};
+    size_t start = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        size_t end = spec.find(L':', start);
+        if ((end == std::wstring::npos) != (i == 3)) {
+            return false;
+        }
+        std::wstring field = spec.substr(start, end == std::wstring::npos ? std::wstring::npos : end - start);
+        wchar_t* parsedEnd = nullptr;
+        values[i] = std::wcstod(field.c_str(), &parsedEnd);
+        if (field.empty() || *parsedEnd != L'\0' || values[i] < 0) {
+            return false;
+        }
+        start = end + 1;
+    }
+    profile = DeviceProfile{ spec, values[0], values[1], values[2], values[3] };
+    return true;
+}
+
+//
+// SimulatedDevice stands in front of ReadFile/WriteFile for one source or destination
+// device and makes it behave like a slower or less reliable one, so pipeline tuning for
+// SAN and USB targets can be exercised on an ordinary disk. The bandwidth cap serialises
+// transfer time across all threads using the device, while latency and jitter overlap
+// between concurrent requests as they would on a device with a deep queue. Injected
+// failures happen before the real I/O, which is therefore never partially performed.
+//
+class SimulatedDevice {
+private:
+    DeviceProfile profile;
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point busyUntil;    // guarded by mutex
+
+    static double Random() {
+        thread_local std::mt19937 generator{ std::random_device{}() };
+        return std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+    }
+
+    // Sleeps for the simulated service time of a transfer and decides whether it fails.
+    bool Delay(DWORD bytes) {
+        auto now = std::chrono::steady_clock::now();
+        auto done = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(profile.latencyMs + profile.jitterMs * Random()));
+        if (profile.megabytesPerSec > 0) {
+            auto transfer = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(bytes / (profile.megabytesPerSec * 1024 * 1024)));
+            std::lock_guard<std::mutex> lock(mutex);
+            busyUntil = (std::max)(busyUntil, now) + transfer;
+            done = (std::max)(done, busyUntil);
+        }
+        std::this_thread::sleep_until(done);
+        return Random() * 100 >= profile.errorPercent;
+    }
+
+public:
+    explicit SimulatedDevice(const DeviceProfile& deviceProfile) : profile(deviceProfile) {
+    }
+
+    BOOL Read(HANDLE file, LPVOID buffer, DWORD length, LPDWORD bytesRead, LPOVERLAPPED overlapped) {
+        if (profile.Enabled() && !Delay(length)) {
+            SetLastError(ERROR_IO_DEVICE);
+            return FALSE;
+        }
+        return ReadFile(file, buffer, length, bytesRead, overlapped);
+    }
+
+    BOOL Write(HANDLE file, LPCVOID buffer, DWORD length, LPDWORD bytesWritten, LPOVERLAPPED overlapped) {
+        if (profile.Enabled() && !Delay(length)) {
+            SetLastError(ERROR_IO_DEVICE);
+            return FALSE;
+        }
+        return WriteFile(file, buffer, length, bytesWritten, overlapped);
+    }
+};
+
+//
+// Path text helpers: UTF-16 to UTF-8 for the run report, and case folding for exclusion
+// matching. Paths are nearly always ASCII, so both take eight UTF-16 units per SSE2 step
+// and fall back to scalar code only for a block holding something else. Builds without
+// SSE2 (ARM64) run the scalar code throughout and produce the same output; the *Scalar
+// forms are that code on its own, which tests/path_text_check.cpp compares against.
+//
+
+// Encodes the character starting at text[i] into dest and advances i past it (two units
+// for a surrogate pair). Returns the end of the bytes written.
+inline char* EncodeUtf8(const wchar_t* text, size_t length, size_t& i, char* dest) {
+    unsigned int c = static_cast<unsigned int>(text[i++]);
+    if (c < 0x80) {
+        *dest++ = static_cast<char>(c);
+        return dest;
+    }
+    if (c < 0x800) {
+        *dest++ = static_cast<char>(0xC0 | (c >> 6));
+        *dest++ = static_cast<char>(0x80 | (c & 0x3F));
+        return dest;
+    }
+    if (c >= 0xD800 && c <= 0xDFFF) {
+        unsigned int low = i < length ? static_cast<unsigned int>(text[i]) : 0;
+        if (c <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+            i++;
+            *dest++ = static_cast<char>(0xF0 | (c >> 18));
+            *dest++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            *dest++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *dest++ = static_cast<char>(0x80 | (c & 0x3F));
+            return dest;
+        }
+        c = 0xFFFD;
+    }
+    *dest++ = static_cast<char>(0xE0 | (c >> 12));
+    *dest++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    *dest++ = static_cast<char>(0x80 | (c & 0x3F));
+    return dest;
+}
+
+void AppendUtf8Scalar(const wchar_t* text, size_t length, std::string& out) {
+    size_t used = out.size();
+    out.resize(used + length * 3);
+    char* dest = &out[0] + used;
+    for (size_t i = 0; i < length;) {
+        dest = EncodeUtf8(text, length, i, dest);
+    }
+    out.resize(static_cast<size_t>(dest - out.data()));
+}
+
+// Appends the UTF-8 form of text to out. Unpaired surrogates become U+FFFD, as
+// WideCharToMultiByte does.
+void AppendUtf8(const wchar_t* text, size_t length, std::string& out) {
+    size_t used = out.size();
+    out.resize(used + length * 3);    // one UTF-16 unit never needs more than 3 bytes
+    char* dest = &out[0] + used;
+    size_t i = 0;
+    while (i < length) {
+#ifdef PATH_TEXT_SSE2
+        if (length - i >= 8) {
+            __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+            __m128i high = _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), _mm_packus_epi16(units, units));
+                dest += 8;
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        dest = EncodeUtf8(text, length, i, dest);
+    }
+    out.resize(static_cast<size_t>(dest - out.data()));
+}
+
+// Upper-cases units in place, one at a time.
+inline void FoldUnits(wchar_t* units, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (units[i] >= L'a' && units[i] <= L'z') {
+            units[i] -= 0x20;
+        }
+        else if (units[i] >= 0x80) {
+            CharUpperBuffW(units + i, 1);
+        }
+    }
+}
+
+void FoldPathCaseScalar(const wchar_t* text, size_t length, std::wstring& out) {
+    out.assign(text, length);
+    FoldUnits(&out[0], length);
+}
+
+// Writes the upper-cased form of text to out, which keeps its capacity between calls.
+// Upper case is what NTFS compares names by; characters outside ASCII go through
+// CharUpperBuffW, one block at a time.
+void FoldPathCase(const wchar_t* text, size_t length, std::wstring& out) {
+    out.assign(text, length);
+    wchar_t* units = &out[0];
+    size_t i = 0;
+#ifdef PATH_TEXT_SSE2
+    const __m128i belowA = _mm_set1_epi16(L'a' - 1);
+    const __m128i aboveZ = _mm_set1_epi16(L'z' + 1);
+    const __m128i caseBit = _mm_set1_epi16(0x20);
+    const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+    for (; length - i >= 8; i += 8) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(units + i));
+        // Signed compares: units from 0x8000 up look negative and so are never a-z.
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi16(block, belowA), _mm_cmplt_epi16(block, aboveZ));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(units + i), _mm_sub_epi16(block, _mm_and_si128(lower, caseBit)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(block, nonAscii), _mm_setzero_si128())) != 0xFFFF) {
+            CharUpperBuffW(units + i, 8);
+        }
+    }
+#endif
+    FoldUnits(units + i, length - i);
+}
+
+//
+// PathDictionary holds a sorted set of relative paths front-coded: each path stores only
+// what differs from the one before it, and every kRestartInterval-th path is stored whole
+// so a lookup binary searches those restart points and then decodes at most one block.
+// Paths are ordered by parent directory, with '\' sorting below every other character,
+// and then by name, so the files of one directory are adjacent and a whole subtree is one
+// contiguous range. Like NTFS names they are ordered and matched ignoring case. A bit vector marks where each directory's run of files begins;
+// DirectoryOf (rank) and FirstOfDirectory (select) map between the two.
+//
+class PathDictionary {
+private:
+    static const size_t kRestartInterval = 16;
+
+    std::vector<wchar_t> text;          // per path: shared length, suffix length, suffix
+    std::vector<ULONGLONG> restarts;    // offset in text of every kRestartInterval-th path
+    std::vector<ULONGLONG> runStarts;   // bit i is set when path i starts a directory's run
+    std::vector<size_t> runsBefore;     // set bits in runStarts before each word
+    size_t count = 0;
+    size_t runs = 0;
+    std::wstring last;                  // the most recently appended path
+
+    static size_t NameStart(const wchar_t* path, size_t length) {
+        for (size_t i = length; i > 0; --i) {
+            if (path[i - 1] == L'\\') {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    // A path unit upper-cased the way FoldPathCase does it.
+    static unsigned int Folded(wchar_t c) {
+        FoldUnits(&c, 1);
+        return static_cast<unsigned int>(c);
+    }
+
+    static bool SameFolded(const wchar_t* a, const wchar_t* b, size_t length) {
+        for (size_t i = 0; i < length; ++i) {
+            if (a[i] != b[i] && Folded(a[i]) != Folded(b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static size_t PopCount(ULONGLONG word) {
+        word = word - ((word >> 1) & 0x5555555555555555ULL);
+        word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+        word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        return static_cast<size_t>((word * 0x0101010101010101ULL) >> 56);
+    }
+
+    void BuildRankIndex() {
+        runsBefore.assign(runStarts.size() + 1, 0);
+        for (size_t i = 0; i < runStarts.size(); ++i) {
+            runsBefore[i + 1] = runsBefore[i] + PopCount(runStarts[i]);
+        }
+        runs = runsBefore.back();
+    }
+
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    // Decodes paths in order, starting at a restart point.
+    class Cursor {
+    private:
+        const PathDictionary* dictionary;
+        size_t next;
+        size_t offset;
+        std::wstring current;
+
+    public:
+        Cursor(const PathDictionary& owner, size_t block)
+            : dictionary(&owner), next(block * kRestartInterval),
+            offset(block < owner.restarts.size() ? static_cast<size_t>(owner.restarts[block]) : owner.text.size()) {
+        }
+
+        // Moves to the next path; false once past the last one.
+        bool Next() {
+            if (next >= dictionary->count) {
+                return false;
+            }
+            size_t shared = static_cast<size_t>(dictionary->text[offset]);
+            size_t suffix = static_cast<size_t>(dictionary->text[offset + 1]);
+            current.resize(shared);
+            current.append(dictionary->text.data() + offset + 2, suffix);
+            offset += 2 + suffix;
+            next++;
+            return true;
+        }
+
+        size_t Index() const {
+            return next - 1;
+        }
+
+        const std::wstring& Path() const {
+            return current;
+        }
+    };
+
+    // Orders two relative paths ignoring case: <0, 0 or >0.
+    static int Compare(const wchar_t* a, size_t aLength, const wchar_t* b, size_t bLength) {
+        size_t aName = NameStart(a, aLength);
+        size_t bName = NameStart(b, bLength);
+        size_t aParent = aName ? aName - 1 : 0;
+        size_t bParent = bName ? bName - 1 : 0;
+        for (size_t i = 0; i < aParent && i < bParent; ++i) {
+            if (a[i] != b[i]) {
+                unsigned int x = a[i] == L'\\' ? 0 : Folded(a[i]) + 1;
+                unsigned int y = b[i] == L'\\' ? 0 : Folded(b[i]) + 1;
+                if (x != y) {
+                    return x < y ? -1 : 1;
+                }
+            }
+        }
+        if (aParent != bParent) {
+            return aParent < bParent ? -1 : 1;
+        }
+        for (size_t i = aName, j = bName; i < aLength && j < bLength; ++i, ++j) {
+            if (a[i] != b[j] && Folded(a[i]) != Folded(b[j])) {
+                return Folded(a[i]) < Folded(b[j]) ? -1 : 1;
+            }
+        }
+        size_t aRest = aLength - aName;
+        size_t bRest = bLength - bName;
+        return aRest == bRest ? 0 : (aRest < bRest ? -1 : 1);
+    }
+
+    // Adds a path ordered after every path added so far (see Compare). Paths are at most
+    // 32767 characters, the Windows limit, so both lengths fit in one UTF-16 unit.
+    void Append(const wchar_t* path, size_t length) {
+        size_t shared = 0;
+        if (count % kRestartInterval == 0) {
+            restarts.push_back(text.size());
+        }
+        else {
+            while (shared < length && shared < last.size() && path[shared] == last[shared]) {
+                shared++;
+            }
+        }
+        size_t name = NameStart(path, length);
+        size_t lastName = NameStart(last.data(), last.size());
+        if (count % 64 == 0) {
+            runStarts.push_back(0);
+        }
+        if (count == 0 || name != lastName || !SameFolded(last.data(), path, name)) {
+            runStarts.back() |= 1ULL << (count % 64);
+        }
+        text.push_back(static_cast<wchar_t>(shared));
+        text.push_back(static_cast<wchar_t>(length - shared));
+        text.insert(text.end(), path + shared, path + length);
+        last.assign(path, length);
+        count++;
+    }
+
+    // Call once every path has been appended.
+    void Finish() {
+        BuildRankIndex();
+        last.clear();
+        last.shrink_to_fit();
+    }
+
+    size_t Size() const {
+        return count;
+    }
+
+    size_t Directories() const {
+        return runs;
+    }
+
+    // Positions a cursor on the first path not ordered before key and returns true, or
+    // returns false when there is none.
+    bool Seek(const std::wstring& key, Cursor& cursor) const {
+        size_t low = 0;
+        size_t high = restarts.size();
+        while (high - low > 1) {
+            size_t middle = (low + high) / 2;
+            size_t offset = static_cast<size_t>(restarts[middle]);
+            if (Compare(text.data() + offset + 2, static_cast<size_t>(text[offset + 1]), key.data(), key.size()) < 0) {
+                low = middle;
+            }
+            else {
+                high = middle;
+            }
+        }
+        cursor = Cursor(*this, low);
+        while (cursor.Next()) {
+            if (Compare(cursor.Path().data(), cursor.Path().size(), key.data(), key.size()) >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Index of path (the first, should a case-sensitive folder have held several spellings
+    // of it), or npos.
+    size_t Find(const std::wstring& path) const {
+        Cursor cursor(*this, 0);
+        if (!Seek(path, cursor) || Compare(cursor.Path().data(), cursor.Path().size(), path.data(), path.size()) != 0) {
+            return npos;
+        }
+        return cursor.Index();
+    }
+
+    // Calls visit(index, path) for every path under directory ("" for all), in order.
+    template <typename Visit>
+    void ForEachUnder(const std::wstring& directory, Visit visit) const {
+        Cursor cursor(*this, 0);
+        bool found = directory.empty() ? cursor.Next() : Seek(directory + L"\\", cursor);
+        for (; found; found = cursor.Next()) {
+            const std::wstring& path = cursor.Path();
+            if (!directory.empty() && (path.size() <= directory.size() || path[directory.size()] != L'\\' ||
+                !SameFolded(path.data(), directory.data(), directory.size()))) {
+                break;
+            }
+            visit(cursor.Index(), path);
+        }
+    }
+
+    // The directory run (0-based) that path index belongs to.
+    size_t DirectoryOf(size_t index) const {
+        ULONGLONG upTo = runStarts[index / 64] & (~0ULL >> (63 - index % 64));
+        return runsBefore[index / 64] + PopCount(upTo) - 1;
+    }
+
+    // Index of the first path of directory run 'run', or Size() past the last run.
+    size_t FirstOfDirectory(size_t run) const {
+        if (run >= runs) {
+            return count;
+        }
+        size_t word = static_cast<size_t>(std::upper_bound(runsBefore.begin(), runsBefore.end(), run) - runsBefore.begin()) - 1;
+        ULONGLONG bits = runStarts[word];
+        for (size_t skip = run - runsBefore[word]; skip > 0; --skip) {
+            bits &= bits - 1;
+        }
+        size_t bit = 0;
+        while (!(bits & (1ULL << bit))) {
+            bit++;
+        }
+        return word * 64 + bit;
+    }
+
+    // Serializes the paths in their front-coded form; restart points and directory runs
+    // are rebuilt on load.
+    void AppendTo(std::string& out) const {
+        ULONGLONG header[2] = { count, text.size() };
+        out.append(reinterpret_cast<const char*>(header), sizeof(header));
+        if (!text.empty()) {
+            out.append(reinterpret_cast<const char*>(text.data()), text.size() * sizeof(wchar_t));
+        }
+    }
+
+    // Loads what AppendTo wrote, starting at data[pos], and advances pos past it. Fails on
+    // an empty path, or one ordered before or equal to the path before it, which Append
+    // would never have been given; only spellings differing in case may compare equal.
+    bool ReadFrom(const std::string& data, size_t& pos) {
+        ULONGLONG header[2];
+        if (data.size() - pos < sizeof(header)) {
+            return false;
+        }
+        memcpy(header, data.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        if (header[1] > (data.size() - pos) / sizeof(wchar_t)) {
+            return false;
+        }
+        std::vector<wchar_t> coded(static_cast<size_t>(header[1]));
+        if (!coded.empty()) {
+            memcpy(coded.data(), data.data() + pos, coded.size() * sizeof(wchar_t));
+            pos += coded.size() * sizeof(wchar_t);
+        }
+
+        *this = PathDictionary();
+        std::wstring path;
+        size_t offset = 0;
+        for (ULONGLONG i = 0; i < header[0]; ++i) {
+            if (coded.size() - offset < 2) {
+                return false;
+            }
+            size_t shared = static_cast<size_t>(coded[offset]);
+            size_t suffix = static_cast<size_t>(coded[offset + 1]);
+            if (shared > path.size() || suffix > coded.size() - offset - 2) {
+                return false;
+            }
+            path.resize(shared);
+            path.append(coded.data() + offset + 2, suffix);
+            offset += 2 + suffix;
+            if (path.empty() || (i > 0 && (Compare(last.data(), last.size(), path.data(), path.size()) > 0 || path == last))) {
+                return false;
+            }
+            Append(path.data(), path.size());
+        }
+        Finish();
+        return offset == coded.size();
+    }
+};
+
+//
+// FileCatalog records where each copied file went: its path under the source root, the
+// destination folder holding it and its size. For a striped copy it is the only record
+// of which folder to restore a file from. Layout: magic, the destination roots (count,
+// then length-prefixed UTF-16 each), the paths as a PathDictionary, then one WORD
+// destination index and one ULONGLONG size per path in dictionary order.
+//
+class FileCatalog {
+private:
+    static constexpr char kMagic[8] = "BKCAT02";
+
+    template <typename T>
+    static void Put(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool Get(const std::string& data, size_t& pos, T& value) {
+        if (data.size() - pos < sizeof(value)) {
+            return false;
+        }
+        memcpy(&value, data.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+public:
+    struct Entry {
+        const wchar_t* path;
+        size_t length;
+        WORD destination;
+        ULONGLONG size;
+    };
+
+    // Returns the catalog file's contents. Sorts entries.
+    static std::string Build(const std::vector<std::wstring>& roots, std::vector<Entry>& entries) {
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return PathDictionary::Compare(a.path, a.length, b.path, b.length) < 0;
+        });
+        PathDictionary paths;
+        for (const Entry& entry : entries) {
+            paths.Append(entry.path, entry.length);
+        }
+        paths.Finish();
+
+        std::string out(kMagic, sizeof(kMagic));
+        Put(out, static_cast<ULONGLONG>(roots.size()));
+        for (const std::wstring& root : roots) {
+            Put(out, static_cast<ULONGLONG>(root.size()));
+            out.append(reinterpret_cast<const char*>(root.data()), root.size() * sizeof(wchar_t));
+        }
+        paths.AppendTo(out);
+        for (const Entry& entry : entries) {
+            Put(out, entry.destination);
+        }
+        for (const Entry& entry : entries) {
+            Put(out, entry.size);
+        }
+        return out;
+    }
+
+    // Prints the file 'under' names, or every file below the directory 'under' ("" for
+    // all) grouped by directory. Returns the process exit code.
+    static int List(const std::filesystem::path& path, std::wstring under) {
+        std::ifstream in(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t pos = sizeof(kMagic);
+        ULONGLONG rootCount = 0;
+        std::vector<std::wstring> roots;
+        PathDictionary paths;
+        bool intact = data.size() >= pos && memcmp(data.data(), kMagic, sizeof(kMagic)) == 0 &&
+            Get(data, pos, rootCount) && rootCount <= (data.size() - pos) / sizeof(ULONGLONG);
+        for (ULONGLONG i = 0; intact && i < rootCount; ++i) {
+            ULONGLONG length = 0;
+            intact = Get(data, pos, length) && length <= (data.size() - pos) / sizeof(wchar_t);
+            if (intact) {
+                roots.emplace_back(reinterpret_cast<const wchar_t*>(data.data() + pos), static_cast<size_t>(length));
+                pos += static_cast<size_t>(length) * sizeof(wchar_t);
+            }
+        }
+        intact = intact && paths.ReadFrom(data, pos) &&
+            data.size() - pos == paths.Size() * (sizeof(WORD) + sizeof(ULONGLONG));
+        if (!intact) {
+            std::wcerr << L"Not a file catalog, or damaged: " << path.wstring() << L"\n";
+            return 2;
+        }
+        const char* destinations = data.data() + pos;
+        const char* sizes = destinations + paths.Size() * sizeof(WORD);
+        auto print = [&](size_t index, const std::wstring& name) {
+            WORD destination;
+            ULONGLONG size;
+            memcpy(&destination, destinations + index * sizeof(WORD), sizeof(destination));
+            memcpy(&size, sizes + index * sizeof(ULONGLONG), sizeof(size));
+            std::wcout << L"  " << name << L"  " << size << L" bytes  in "
+                << (destination < roots.size() ? roots[destination] : L"?") << L"\n";
+        };
+
+        std::replace(under.begin(), under.end(), L'/', L'\\');
+        size_t first = under.find_first_not_of(L'\\');
+        under = first == std::wstring::npos ? std::wstring() : under.substr(first, under.find_last_not_of(L'\\') - first + 1);
+        size_t exact = under.empty() ? PathDictionary::npos : paths.Find(under);
+        if (exact != PathDictionary::npos) {
+            print(exact, under);
+            return 0;
+        }
+
+        size_t files = 0;
+        size_t directories = 0;
+        size_t run = PathDictionary::npos;
+        paths.ForEachUnder(under, [&](size_t index, const std::wstring& file) {
+            size_t nameStart = file.rfind(L'\\') == std::wstring::npos ? 0 : file.rfind(L'\\') + 1;
+            if (paths.DirectoryOf(index) != run) {
+                run = paths.DirectoryOf(index);
+                std::wcout << (nameStart ? file.substr(0, nameStart - 1) : L"(root)") << L" ("
+                    << paths.FirstOfDirectory(run + 1) - paths.FirstOfDirectory(run) << L" files)\n";
+                directories++;
+            }
+            print(index, file.substr(nameStart));
+            files++;
+        });
+        if (files == 0) {
+            std::wcerr << L"No files under '" << under << L"' in " << path.wstring() << L"\n";
+            return 1;
+        }
+        std::wcout << files << L" files in " << directories << L" directories (catalog holds "
+            << paths.Size() << L" files in " << paths.Directories() << L" directories).\n";
+        return 0;
+    }
+};
+
+//
+// CopyOptions carries the user's choices from the command line into the copy engine.
+//
+struct CopyOptions {
+    // Open sources and destinations with FILE_FLAG_NO_BUFFERING so a backup does not
+    // evict the page cache that the machine's own workload depends on.
+    bool bypassCache = true;
+    // Compare each block with the existing destination copy and rewrite only the blocks
+    // that differ, instead of recreating every file from scratch.
+    bool updateInPlace = false;
+    // Slow or flaky device behaviour to impose on every source and destination device
+    // (see SimulatedDevice); disabled unless requested.
+    DeviceProfile simulateSource;
+    DeviceProfile simulateDestination;
+    // Back the I/O buffer pools with large pages when the account may lock pages in memory.
+    bool largePages = false;
+    // File or directory names (pagefile.sys) and paths under the source root
+    // (Users\me\AppData\Local\Temp) to leave out, matched case-insensitively as NTFS does.
+    std::vector<std::wstring> exclude;
+    // Where to write the file catalog (see FileCatalog); empty for none.
+    std::wstring catalogPath;
+    // Walk into volumes mounted under the source. They are not in the snapshot set, so
+    // their files are copied live and the backup is no longer one point in time.
+    bool followMounts = false;
+};
+
+//
+// FileTask describes one file travelling through the copy pipeline. The reader fills in
+// basicInfo and picks the writer lane before queueing the first block; that lane's
+// writer thread owns destHandle.
+//
+struct FileTask {
+    std::wstring relPath;
+    ULONGLONG size = 0;
+    size_t destIndex = 0;
+    size_t lane = 0;
+    ULONGLONG cost = 0;     // bytes still counted in the destination's queuedBytes
+    FILE_BASIC_INFO basicInfo = {};
+    HANDLE destHandle = INVALID_HANDLE_VALUE;
+    bool destUnbuffered = false;
+    bool destExisted = false;
+    ULONGLONG written = 0;
+    bool failed = false;    // owned by the writer lane; read failures arrive on the last Block
+
+    // Where the file's time went, for the slowest-files report.
+    std::chrono::steady_clock::time_point queuedAt;
+    std::chrono::steady_clock::time_point readStart;
+    ULONGLONG openMicros = 0;
+    ULONGLONG readMicros = 0;
+    ULONGLONG bufferWaitMicros = 0;
+    ULONGLONG writeMicros = 0;
+
+    // Clears the record for reuse while keeping relPath's buffer, so a recycled record
+    // takes the next path without allocating.
+    void Reset() {
+        std::wstring path = std::move(relPath);
+        path.clear();
+        *this = FileTask();
+        relPath = std::move(path);
+    }
+};
+
+//
+// FileTaskPool recycles FileTask records. A record is taken when the scanner finds a
+// file and returned by whoever finishes with it last (the writer, or the reader if the
+// source cannot be opened), so once the pool has warmed up, scanning and copying a file
+// allocate no records or path strings. Records beyond the pool's capacity are freed.
+//
+class FileTaskPool {
+private:
+    BlockingQueue<FileTask*> free;
+
+public:
+    explicit FileTaskPool(size_t capacity) : free(capacity) {
+    }
+
+    ~FileTaskPool() {
+        FileTask* task = nullptr;
+        while (free.TryPop(task)) {
+            delete task;
+        }
+    }
+
+    FileTaskPool(const FileTaskPool&) = delete;
+    FileTaskPool& operator=(const FileTaskPool&) = delete;
+
+    FileTask* Acquire() {
+        FileTask* task = nullptr;
+        if (free.TryPop(task)) {
+            task->Reset();
+            return task;
+        }
+        return new FileTask();
+    }
+
+    void Release(FileTask* task) {
+        if (!free.TryPush(task)) {
+            delete task;
+        }
+    }
+};
+
+//
+// Block is a chunk of file data on its way from a reader to a destination writer.
+// data is nullptr for the end-of-file marker of empty or failed files. A read failure
+// travels on that marker rather than in FileTask::failed, which belongs to the writer.
+//
+struct Block {
+    FileTask* file = nullptr;
+    BYTE* data = nullptr;
+    DWORD length = 0;
+    bool last = false;
+    bool readFailed = false;
+};
+
+//
+// Attributes carried over to the copy; compression, encryption, sparseness and reparse
+// data are properties of the source volume, not of the file's contents.
+//
+const DWORD kCopiedAttributes = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN |
+    FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
+//
+// MakeBasicInfo converts the attributes and times returned by directory listings and
+// GetFileAttributesExW into the FILE_BASIC_INFO applied to copies. A zero ChangeTime
+// tells SetFileInformationByHandle to leave it alone.
+//
+FILE_BASIC_INFO MakeBasicInfo(DWORD attributes, const FILETIME& created, const FILETIME& accessed,
+    const FILETIME& written) {
+    auto toLarge = [](const FILETIME& time) {
+        LARGE_INTEGER value;
+        value.LowPart = time.dwLowDateTime;
+        value.HighPart = static_cast<LONG>(time.dwHighDateTime);
+        return value;
+    };
+    FILE_BASIC_INFO info = {};
+    info.CreationTime = toLarge(created);
+    info.LastAccessTime = toLarge(accessed);
+    info.LastWriteTime = toLarge(written);
+    info.FileAttributes = attributes & kCopiedAttributes;
+    return info;
+}
+
+//
+// ParallelFor runs body(i) for every i in [begin, end) as up to 'tasks' scheduler tasks
+// of the given priority and returns once all of them have finished.
+//
+template <typename Body>
+void ParallelFor(size_t begin, size_t end, size_t tasks, TaskScheduler::Priority priority, Body body) {
+    std::atomic<size_t> next{ begin };
+    TaskGroup group;
+    for (size_t t = 0; t < tasks && t < end - begin; ++t) {
+        Scheduler().Submit(priority, [&] {
+            for (size_t i = next++; i < end; i = next++) {
+                body(i);
+            }
+        }, &group);
+    }
+    BlockingScope waiting;
+    group.Wait();
+}
+
+//
+// ResolveSourceDevice names the physical disk behind 'path' ("PhysicalDrive1") so that
+// volumes sharing a disk share one I/O queue. Volumes without a single backing disk
+// (shadow copies, spanned or network volumes) are keyed by their own volume name.
+//
+std::wstring ResolveSourceDevice(const std::wstring& path) {
+    wchar_t volumeRoot[MAX_PATH];
+    if (!GetVolumePathNameW(path.c_str(), volumeRoot, MAX_PATH)) {
+        return path;
+    }
+    wchar_t volumeName[MAX_PATH];
+    if (!GetVolumeNameForVolumeMountPointW(volumeRoot, volumeName, MAX_PATH)) {
+        return volumeRoot;
+    }
+
+    // Open the volume itself ("\\?\Volume{...}"), not its root directory.
+    std::wstring volumeDevice = volumeName;
+    if (!volumeDevice.empty() && volumeDevice.back() == L'\\') {
+        volumeDevice.pop_back();
+    }
+    HANDLE hVolume = CreateFileW(volumeDevice.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        return volumeName;
+    }
+    VOLUME_DISK_EXTENTS extents;
+    DWORD bytesReturned = 0;
+    BOOL ok = DeviceIoControl(hVolume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS,
+        NULL, 0, &extents, sizeof(extents), &bytesReturned, NULL);
+    CloseHandle(hVolume);
+    if (!ok || extents.NumberOfDiskExtents != 1) {
+        return volumeName;
+    }
+    return L"PhysicalDrive" + std::to_wstring(extents.Extents[0].DiskNumber);
+}
+
+//
+// CopySummary is what one StripedCopyEngine run reports: stage timings, totals,
+// per-device statistics, the slowest files and the worker-count trajectory.
+//
+struct CopySummary {
+    struct DeviceStats {
+        std::wstring name;
+        ULONGLONG files = 0;
+        ULONGLONG bytes = 0;
+        ULONGLONG bytesRewritten = 0;
+        double mbPerSec = 0;
+        double msPerIo = 0;
+    };
+
+    struct TrajectoryPoint {
+        double seconds = 0;
+        std::vector<std::pair<std::wstring, size_t>> workers;
+        double mbPerSec = 0;
+        double msPerIo = 0;
+    };
+
+    double scanSeconds = 0;         // until the last directory was listed
+    double copySeconds = 0;         // until the last file was written (includes the scan)
+    double directorySeconds = 0;    // creating empty directories and applying their metadata
+    ULONGLONG files = 0;
+    ULONGLONG bytes = 0;
+    ULONGLONG directories = 0;
+    ULONGLONG filesFailed = 0;
+    ULONGLONG directoriesFailed = 0;
+    ULONGLONG excluded = 0;         // files and directories skipped by an exclusion
+    std::vector<DeviceStats> sources;
+    std::vector<DeviceStats> destinations;
+    std::vector<SlowFileTracker::Entry> slowestFiles;
+    std::vector<TrajectoryPoint> trajectory;
+    TaskScheduler::Stats scheduler;
+    ULONGLONG heapAllocations = 0;  // made by the whole process during the copy (diagnostics builds)
+    bool largePages = false;        // whether every I/O buffer (and scratch buffer) ended up on large pages
+    ULONGLONG catalogBytes = 0;     // size of the file catalog, if one was requested
+};
+
+//
+// StripedCopyEngine copies a directory tree into one or more destination folders.
+// With several folders (ideally on different devices) each file goes to exactly one
+// of them, chosen by free space and the observed write speed of each folder, so the
+// mirror is striped and the union of all folders is the complete tree.
+//
+// I/O is queued per device on both sides: every source disk (reached through a volume
+// mount point, with --follow-mounts) gets its own read queue and reader pool, and every destination its own
+// writer lanes, so one slow disk cannot tie up the workers of the others. Worker pools
+// are started at their maximum size and an AdaptiveConcurrency controller decides how
+// many workers of each pool are active at a time.
+//
+class StripedCopyEngine {
+private:
+    static constexpr size_t kMaxScanners = 4;
+    static constexpr size_t kMaxReadersPerDevice = 16;
+    static constexpr size_t kMaxWriteLanes = 8;
+    static constexpr DWORD kBlockSize = 1024 * 1024;
+    // Unbuffered I/O needs sector-multiple lengths; 4 KB covers 512e and 4Kn disks.
+    static constexpr DWORD kSectorAlignment = 4096;
+    static constexpr size_t kBuffersPerThread = 2;
+    static constexpr size_t kReadQueueDepth = 4096;
+    static constexpr size_t kLaneQueueDepth = 1024;
+    static constexpr size_t kWriteBatch = 16;
+    // ERROR_IO_DEVICE transfers are reissued this many times, after 1, 2, 4... ms.
+    static constexpr int kIoRetries = 4;
+    static constexpr size_t kScanBatch = 64;
+    static constexpr size_t kTaskPoolSize = 8192;
+    static constexpr size_t kMetadataTasks = 8;
+    static constexpr size_t kSlowFilesReported = 20;
+    // Small files cost about as much as one cluster-sized write plus the create/close.
+    static constexpr ULONGLONG kMinCostBytes = 64 * 1024;
+    static constexpr double kInitialBytesPerSec = 100.0 * 1024 * 1024;
+
+    struct SourceDevice {
+        explicit SourceDevice(const DeviceProfile& profile) : io(profile) {
+        }
+
+        std::wstring name;
+        SimulatedDevice io;
+        BlockingQueue<FileTask*> queue{ kReadQueueDepth };
+        WorkerGate readGate{ 4 };
+        std::vector<std::thread> readers;
+        std::atomic<ULONGLONG> filesRead{ 0 };
+        std::atomic<ULONGLONG> bytesRead{ 0 };
+        std::atomic<ULONGLONG> ioCount{ 0 };
+        std::atomic<ULONGLONG> ioMicros{ 0 };
+    };
+
+    // A directory waiting to be listed, with the device its files are read from.
+    struct DirTask {
+        std::wstring relDir;
+        SourceDevice* device = nullptr;
+    };
+
+    // A scanned directory whose copy gets created (if still missing) and stamped with
+    // the source attributes and times once every file below it has been written.
+    struct DirectoryRecord {
+        std::wstring relPath;
+        size_t depth = 0;
+        FILE_BASIC_INFO basicInfo = {};
+    };
+
+    // A writer lane preserves block order for every file assigned to it. In update-in-place
+    // mode it reads the existing destination block into its scratch buffer for comparison.
+    struct CatalogRecord {
+        size_t offset;
+        size_t length;
+        ULONGLONG size;
+    };
+
+    struct WriteLane {
+        BlockingQueue<Block> queue{ kLaneQueueDepth };
+        std::thread thread;
+        BYTE* scratch = nullptr;
+        std::unordered_set<std::wstring> createdDirs;
+        std::wstring parentDir;     // reused for every file, to look up createdDirs
+        // Files written, when a catalog was requested: paths end to end in catalogText.
+        std::wstring catalogText;
+        std::vector<CatalogRecord> catalog;
+    };
+
+    struct Destination {
+        explicit Destination(const DeviceProfile& profile) : io(profile) {
+        }
+
+        std::wstring root;
+        SimulatedDevice io;
+        std::vector<std::unique_ptr<WriteLane>> lanes;
+        WorkerGate writeGate{ 1 };
+        std::atomic<size_t> nextLane{ 0 };
+        ULONGLONG freeBytes = 0;
+        ULONGLONG reservedBytes = 0;                     // guarded by placementMutex
+        std::atomic<ULONGLONG> queuedBytes{ 0 };
+        std::atomic<double> laneBytesPerSec{ kInitialBytesPerSec };
+        std::atomic<ULONGLONG> filesWritten{ 0 };
+        std::atomic<ULONGLONG> bytesWritten{ 0 };
+        std::atomic<ULONGLONG> bytesRewritten{ 0 };
+        std::atomic<ULONGLONG> ioCount{ 0 };
+        std::atomic<ULONGLONG> ioMicros{ 0 };
+    };
+
+    std::wstring sourceRoot;
+    CopyOptions options;
+    std::vector<std::unique_ptr<SourceDevice>> sourceDevices;  // guarded by deviceMutex
+    std::unordered_set<std::wstring> mountedVolumes;           // guarded by deviceMutex
+    std::unordered_set<std::wstring> destinationVolumes;       // set before the scan starts
+    std::vector<std::unique_ptr<Destination>> destinations;
+    std::atomic<size_t> pendingDirs{ 0 };
+    std::deque<DirTask> deferredDirs;                          // guarded by scanMutex
+    size_t scansRunning = 0;                                   // guarded by scanMutex
+    std::mutex scanMutex;
+    std::condition_variable scanDone;
+    std::vector<DirectoryRecord> directories;                  // guarded by directoryMutex
+    std::mutex directoryMutex;
+    std::unique_ptr<BufferPool> bufferPool;
+    std::unique_ptr<BufferPool> scratchPool;
+    std::unique_ptr<AdaptiveConcurrency> controller;
+    SlowFileTracker slowFiles{ kSlowFilesReported };
+    FileTaskPool taskPool{ kTaskPoolSize };
+    WorkerGate scanGate{ 1 };
+    std::mutex deviceMutex;
+    std::mutex placementMutex;
+    std::atomic<ULONGLONG> completedCost{ 0 };
+    std::atomic<ULONGLONG> ioCount{ 0 };
+    std::atomic<ULONGLONG> ioMicros{ 0 };
+    std::atomic<ULONGLONG> filesFailed{ 0 };
+    std::atomic<ULONGLONG> directoriesFailed{ 0 };
+    std::atomic<ULONGLONG> excludedEntries{ 0 };
+    std::unordered_set<std::wstring> excluded;    // options.exclude, case-folded
+    CopySummary summary;
+
+    void ReportError(BinaryLog::Event event, const std::wstring& path, DWORD error) {
+        Log().Write(event, path, error);
+    }
+
+    // Joins a root and a relative path in a buffer owned by the calling thread, which
+    // keeps its capacity from file to file. Valid until the thread's next call.
+    static const std::wstring& ScratchPath(const std::wstring& root, const std::wstring& relPath) {
+        thread_local std::wstring path;
+        path.assign(root).append(relPath);
+        return path;
+    }
+
+    // Whether a listed entry matches an exclusion by its name or by its path under the
+    // source root. Both are folded in buffers owned by the calling thread, so listing a
+    // directory allocates nothing for the check.
+    bool IsExcluded(const std::wstring& relDir, const wchar_t* name) const {
+        if (excluded.empty()) {
+            return false;
+        }
+        thread_local std::wstring path;
+        thread_local std::wstring folded;
+        thread_local std::wstring foldedName;
+        path.assign(relDir).append(name);
+        FoldPathCase(path.data(), path.size(), folded);
+        foldedName.assign(folded, relDir.size(), std::wstring::npos);
+        return excluded.count(foldedName) != 0 || excluded.count(folded) != 0;
+    }
+
+    static ULONGLONG MicrosSince(std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        return static_cast<ULONGLONG>(elapsed.count());
+    }
+
+    // Runs one read or write, reissuing it while it fails with ERROR_IO_DEVICE: the error a
+    // device reports for a request that was never carried out and may succeed if sent
+    // again (see SimulatedDevice). Every other error is final. The transfer must name its
+    // file offset, so a retry cannot skip or repeat data.
+    template <typename Transfer>
+    static bool RetryTransientIo(Transfer transfer) {
+        for (int attempt = 0;; ++attempt) {
+            if (transfer()) {
+                return true;
+            }
+            if (GetLastError() != ERROR_IO_DEVICE || attempt == kIoRetries) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1 << attempt));
+        }
+    }
+
+    ULONGLONG RecordIo(std::chrono::steady_clock::time_point start,
+        std::atomic<ULONGLONG>& deviceCount, std::atomic<ULONGLONG>& deviceMicros) {
+        ULONGLONG micros = MicrosSince(start);
+        ioCount++;
+        ioMicros += micros;
+        deviceCount++;
+        deviceMicros += micros;
+        return micros;
+    }
+
+    // Splits a finished file's wall time into phases and offers it to the slow-file
+    // tracker. Time not spent queued, opening, reading, waiting for a buffer or writing
+    // was spent waiting in the writer lane behind other files.
+    void TrackFileTime(const FileTask& file) {
+        const ULONGLONG totalMicros = MicrosSince(file.queuedAt);
+        const ULONGLONG queuedMicros = static_cast<ULONGLONG>(
+            std::chrono::duration_cast<std::chrono::microseconds>(file.readStart - file.queuedAt).count());
+        const std::pair<const wchar_t*, ULONGLONG> phases[] = {
+            { L"read queue", queuedMicros },
+            { L"open", file.openMicros },
+            { L"read", file.readMicros },
+            { L"buffer wait", file.bufferWaitMicros },
+            { L"write", file.writeMicros },
+        };
+        ULONGLONG accounted = 0;
+        const std::pair<const wchar_t*, ULONGLONG>* stalled = &phases[0];
+        for (const auto& phase : phases) {
+            accounted += phase.second;
+            if (phase.second > stalled->second) {
+                stalled = &phase;
+            }
+        }
+        const wchar_t* stalledPhase = stalled->first;
+        ULONGLONG stalledMicros = stalled->second;
+        if (totalMicros > accounted && totalMicros - accounted > stalledMicros) {
+            stalledPhase = L"write queue";
+            stalledMicros = totalMicros - accounted;
+        }
+        slowFiles.Offer(totalMicros / 1e6, file.relPath, file.written, stalledPhase, stalledMicros / 1e6);
+    }
+
+    // Returns the reader pool for 'name', starting it (and registering it with the
+    // controller) the first time the device is reached.
+    SourceDevice* GetSourceDevice(const std::wstring& name) {
+        std::lock_guard<std::mutex> lock(deviceMutex);
+        for (auto& device : sourceDevices) {
+            if (device->name == name) {
+                return device.get();
+            }
+        }
+        auto device = std::make_unique<SourceDevice>(options.simulateSource);
+        device->name = name;
+        SourceDevice* d = device.get();
+        for (size_t i = 0; i < kMaxReadersPerDevice; ++i) {
+            d->readers.emplace_back([this, d, i] { ReaderLoop(*d, i); });
+        }
+        if (controller) {
+            controller->AddKnob({ L"read " + name, &d->readGate, 1, kMaxReadersPerDevice });
+        }
+        sourceDevices.push_back(std::move(device));
+        return d;
+    }
+
+    // Returns the destination that already holds a copy of the file from an earlier run,
+    // and that copy's size, or SIZE_MAX.
+    size_t FindExistingCopy(const FileTask& task, ULONGLONG& existingSize) {
+        for (size_t i = 0; i < destinations.size(); ++i) {
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (GetFileAttributesExW(ScratchPath(destinations[i]->root, task.relPath).c_str(), GetFileExInfoStandard, &data)) {
+                existingSize = (static_cast<ULONGLONG>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+                return i;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    // Chooses the destination expected to finish this file soonest among those with
+    // room for it. Falls back to the emptiest destination if none has enough space.
+    // In update-in-place mode a striped file stays on the folder holding its earlier
+    // copy, so it is updated rather than duplicated, as long as that folder has room
+    // for the file's growth.
+    void PickDestination(FileTask& task) {
+        auto available = [](const Destination& dest) {
+            return dest.freeBytes > dest.reservedBytes ? dest.freeBytes - dest.reservedBytes : 0;
+        };
+        task.cost = (std::max)(task.size, kMinCostBytes);
+        size_t existing = SIZE_MAX;
+        ULONGLONG existingSize = 0;
+        if (options.updateInPlace && destinations.size() > 1) {
+            existing = FindExistingCopy(task, existingSize);
+        }
+
+        std::lock_guard<std::mutex> lock(placementMutex);
+        size_t best = SIZE_MAX;
+        double bestSeconds = 0;
+        size_t roomiest = 0;
+        for (size_t i = 0; i < destinations.size(); ++i) {
+            Destination& dest = *destinations[i];
+            if (available(dest) > available(*destinations[roomiest])) {
+                roomiest = i;
+            }
+            if (available(dest) < task.size) {
+                continue;
+            }
+            double seconds = static_cast<double>(dest.queuedBytes.load() + task.cost) /
+                (dest.laneBytesPerSec.load() * dest.writeGate.Active());
+            if (best == SIZE_MAX || seconds < bestSeconds) {
+                best = i;
+                bestSeconds = seconds;
+            }
+        }
+        ULONGLONG reserve = task.size;
+        if (existing != SIZE_MAX) {
+            ULONGLONG growth = task.size > existingSize ? task.size - existingSize : 0;
+            if (available(*destinations[existing]) >= growth) {
+                best = existing;
+                reserve = growth;
+            }
+        }
+        if (best == SIZE_MAX) {
+            best = roomiest;
+        }
+        task.destIndex = best;
+        destinations[best]->reservedBytes += reserve;
+        destinations[best]->queuedBytes += task.cost;
+    }
+
+    // Returns the device to read a mounted volume's files from, or nullptr if the
+    // reparse point is a junction, following was not asked for (options.followMounts),
+    // or the volume is a destination or already being walked.
+    SourceDevice* FollowMountPoint(const std::wstring& relPath, const WIN32_FIND_DATAW& findData) {
+        if (findData.dwReserved0 != IO_REPARSE_TAG_MOUNT_POINT) {
+            return nullptr;
+        }
+        std::wstring mountPath = sourceRoot + relPath + L"\\";
+        if (!options.followMounts) {
+            Log().Write(BinaryLog::MountPointNotFollowed, mountPath);
+            return nullptr;
+        }
+        wchar_t volumeName[MAX_PATH];
+        if (!GetVolumeNameForVolumeMountPointW(mountPath.c_str(), volumeName, MAX_PATH)) {
+            return nullptr;
+        }
+        // A destination mounted inside the source would have the scan walk the backup's
+        // own output while the writers are filling it.
+        if (destinationVolumes.count(volumeName)) {
+            Log().Write(BinaryLog::MountPointSkipped, mountPath);
+            return nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(deviceMutex);
+            if (!mountedVolumes.insert(volumeName).second) {
+                return nullptr;
+            }
+        }
+        Log().Write(BinaryLog::MountPointFollowed, mountPath);
+        return GetSourceDevice(ResolveSourceDevice(volumeName));
+    }
+
+    // Hands a file that is still empty straight to a writer lane: there is nothing to read,
+    // so the source is never opened. The listing's size can be stale for files that were
+    // open at snapshot time, so it is confirmed from the file record first. Returns false
+    // if the file turns out to have data and must go through the readers.
+    bool QueueEmptyFile(FileTask* task) {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExW(ScratchPath(sourceRoot, task->relPath).c_str(), GetFileExInfoStandard, &data) ||
+            data.nFileSizeHigh != 0 || data.nFileSizeLow != 0) {
+            return false;
+        }
+        task->basicInfo = MakeBasicInfo(data.dwFileAttributes, data.ftCreationTime,
+            data.ftLastAccessTime, data.ftLastWriteTime);
+        task->readStart = std::chrono::steady_clock::now();
+        Destination& dest = *destinations[task->destIndex];
+        task->lane = dest.nextLane++ % dest.writeGate.Active();
+        dest.lanes[task->lane]->queue.Push(Block{ task, nullptr, 0, true });
+        return true;
+    }
+
+    // Lists one source directory, queueing its subdirectories for the scan workers and
+    // its files for the readers of the directory's device. Directories are only recorded
+    // here; writers create the ones they need and CreateDirectories() adds the rest.
+    // With --follow-mounts, volume mount points are followed onto their own device;
+    // junctions never are, so no part of a volume is copied twice.
+    void ScanDirectory(const DirTask& dir) {
+        std::wstring pattern = sourceRoot + dir.relDir + L"*";
+        WIN32_FIND_DATAW findData;
+        HANDLE hFind = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &findData,
+            FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE) {
+            ReportError(BinaryLog::ListFailed, sourceRoot + dir.relDir, GetLastError());
+            directoriesFailed++;
+            return;
+        }
+        std::vector<DirectoryRecord> found;
+        std::vector<FileTask*> files;
+        files.reserve(kScanBatch);
+        do {
+            const wchar_t* name = findData.cFileName;
+            if (wcscmp(name, L".") == 0 || wcscmp(name, L"..") == 0) {
+                continue;
+            }
+            if (IsExcluded(dir.relDir, name)) {
+                excludedEntries++;
+                continue;
+            }
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                std::wstring relPath = dir.relDir + name;
+                SourceDevice* device = dir.device;
+                if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+                    device = FollowMountPoint(relPath, findData);
+                    if (!device) {
+                        continue;
+                    }
+                }
+                found.push_back(DirectoryRecord{ relPath, static_cast<size_t>(
+                    std::count(relPath.begin(), relPath.end(), L'\\')),
+                    MakeBasicInfo(findData.dwFileAttributes, findData.ftCreationTime,
+                        findData.ftLastAccessTime, findData.ftLastWriteTime) });
+                QueueDirectory(DirTask{ relPath + L"\\", device });
+                continue;
+            }
+
+            FileTask* task = taskPool.Acquire();
+            task->relPath.assign(dir.relDir).append(name);
+            task->size = (static_cast<ULONGLONG>(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+            task->queuedAt = std::chrono::steady_clock::now();
+            PickDestination(*task);
+            if (task->size == 0 && QueueEmptyFile(task)) {
+                continue;
+            }
+            files.push_back(task);
+            if (files.size() == kScanBatch) {
+                dir.device->queue.PushBatch(files);
+            }
+        } while (FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+        dir.device->queue.PushBatch(files);
+
+        std::lock_guard<std::mutex> lock(directoryMutex);
+        directories.insert(directories.end(), std::make_move_iterator(found.begin()),
+            std::make_move_iterator(found.end()));
+    }
+
+    // Creates every scanned directory that writers did not already create (i.e. the empty
+    // ones) in the primary destination, one depth level at a time so that each level's
+    // parents exist, with the directories of a level created concurrently. Then stamps
+    // all directory copies with the source attributes and times in one parallel pass;
+    // this has to wait until the files are written, since each write touches the parent.
+    void CreateDirectories() {
+        std::stable_sort(directories.begin(), directories.end(),
+            [](const DirectoryRecord& a, const DirectoryRecord& b) { return a.depth < b.depth; });
+        const std::wstring& primary = destinations[0]->root;
+        for (size_t begin = 0; begin < directories.size();) {
+            size_t end = begin;
+            while (end < directories.size() && directories[end].depth == directories[begin].depth) {
+                ++end;
+            }
+            ParallelFor(begin, end, kMetadataTasks, TaskScheduler::High, [&](size_t i) {
+                BlockingScope io;
+                std::wstring path = primary + directories[i].relPath;
+                if (!CreateDirectoryW(path.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+                    ReportError(BinaryLog::CreateDirectoryFailed, path, GetLastError());
+                    directoriesFailed++;
+                }
+            });
+            begin = end;
+        }
+
+        ParallelFor(0, directories.size(), kMetadataTasks, TaskScheduler::High, [&](size_t i) {
+            BlockingScope io;
+            for (auto& dest : destinations) {
+                std::wstring path = dest->root + directories[i].relPath;
+                HANDLE hDir = CreateFileW(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                    FILE_FLAG_BACKUP_SEMANTICS, NULL);
+                if (hDir == INVALID_HANDLE_VALUE) {
+                    continue;   // striped destinations only hold the directories their files need
+                }
+                FILE_BASIC_INFO info = directories[i].basicInfo;
+                SetFileInformationByHandle(hDir, FileBasicInfo, &info, sizeof(info));
+                CloseHandle(hDir);
+            }
+        });
+    }
+
+    // Submits a directory listing to the scheduler. Listings run as Normal priority tasks,
+    // so a worker keeps descending into the subdirectories it found while idle workers
+    // steal the shallowest (largest) pending subtrees.
+    void QueueDirectory(const DirTask& dir) {
+        pendingDirs++;
+        SubmitScan(dir);
+    }
+
+    void SubmitScan(const DirTask& dir) {
+        Scheduler().Submit(TaskScheduler::Normal, [this, dir] {
+            if (!TryStartScan(dir)) {
+                return;
+            }
+            {
+                BlockingScope io;
+                ScanDirectory(dir);
+            }
+            FinishScan();
+        });
+    }
+
+    // Keeps the number of concurrent listings within the scan stage's tuned limit; a
+    // listing over the limit is parked until a running one finishes.
+    bool TryStartScan(const DirTask& dir) {
+        std::lock_guard<std::mutex> lock(scanMutex);
+        if (scansRunning >= scanGate.Active()) {
+            deferredDirs.push_back(dir);
+            return false;
+        }
+        scansRunning++;
+        return true;
+    }
+
+    void FinishScan() {
+        std::vector<DirTask> released;
+        {
+            std::lock_guard<std::mutex> lock(scanMutex);
+            scansRunning--;
+            size_t limit = scanGate.Active();
+            while (!deferredDirs.empty() && scansRunning + released.size() < limit) {
+                released.push_back(std::move(deferredDirs.front()));
+                deferredDirs.pop_front();
+            }
+        }
+        for (const DirTask& dir : released) {
+            SubmitScan(dir);
+        }
+        std::lock_guard<std::mutex> lock(scanMutex);
+        if (--pendingDirs == 0) {
+            scanDone.notify_all();
+        }
+    }
+
+    // Opens a source file for one sequential pass. Unbuffered reads keep the file out of
+    // the page cache entirely; the sequential hint covers the buffered fallback.
+    HANDLE OpenSourceFile(const std::wstring& srcPath) {
+        const DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+        HANDLE hSource = INVALID_HANDLE_VALUE;
+        if (options.bypassCache) {
+            hSource = CreateFileW(srcPath.c_str(), GENERIC_READ, share, NULL, OPEN_EXISTING,
+                FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if (hSource != INVALID_HANDLE_VALUE || GetLastError() != ERROR_INVALID_PARAMETER) {
+                return hSource;
+            }
+        }
+        return CreateFileW(srcPath.c_str(), GENERIC_READ, share, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+
+    // Streams each file queued for this device into one lane of its destination.
+    void ReaderLoop(SourceDevice& device, size_t index) {
+        FileTask* task = nullptr;
+        for (;;) {
+            device.readGate.WaitUntilActive(index);
+            if (!device.queue.Pop(task)) {
+                break;
+            }
+            task->readStart = std::chrono::steady_clock::now();
+            const std::wstring& srcPath = ScratchPath(sourceRoot, task->relPath);
+            HANDLE hSource = OpenSourceFile(srcPath);
+            Destination& dest = *destinations[task->destIndex];
+            if (hSource == INVALID_HANDLE_VALUE) {
+                ReportError(BinaryLog::OpenFailed, srcPath, GetLastError());
+                filesFailed++;
+                dest.queuedBytes -= task->cost;
+                taskPool.Release(task);
+                continue;
+            }
+            GetFileInformationByHandleEx(hSource, FileBasicInfo, &task->basicInfo, sizeof(task->basicInfo));
+            task->openMicros = MicrosSince(task->readStart);
+            task->lane = dest.nextLane++ % dest.writeGate.Active();
+            BlockingQueue<Block>& lane = dest.lanes[task->lane]->queue;
+
+            ULONGLONG offset = 0;
+            for (;;) {
+                auto waitStart = std::chrono::steady_clock::now();
+                BYTE* buffer = bufferPool->Acquire();
+                task->bufferWaitMicros += MicrosSince(waitStart);
+                DWORD bytesRead = 0;
+                auto start = std::chrono::steady_clock::now();
+                bool read = RetryTransientIo([&] {
+                    OVERLAPPED at = {};
+                    at.Offset = static_cast<DWORD>(offset);
+                    at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+                    return device.io.Read(hSource, buffer, bufferPool->BufferSize(), &bytesRead, &at) != FALSE;
+                });
+                if (!read && GetLastError() == ERROR_HANDLE_EOF) {
+                    read = true;    // a positioned read at the end of the file fails instead of returning 0 bytes
+                    bytesRead = 0;
+                }
+                if (!read) {
+                    ReportError(BinaryLog::ReadFailed, srcPath, GetLastError());
+                    bufferPool->Release(buffer);
+                    lane.Push(Block{ task, nullptr, 0, true, true });
+                    break;
+                }
+                task->readMicros += RecordIo(start, device.ioCount, device.ioMicros);
+                device.bytesRead += bytesRead;
+                offset += bytesRead;
+                if (bytesRead == 0) {
+                    bufferPool->Release(buffer);
+                    lane.Push(Block{ task, nullptr, 0, true });
+                    break;
+                }
+                bool last = bytesRead < bufferPool->BufferSize();
+                lane.Push(Block{ task, buffer, bytesRead, last });
+                if (last) {
+                    break;
+                }
+            }
+            CloseHandle(hSource);
+            device.filesRead++;
+        }
+    }
+
+    // Creates (or, in update-in-place mode, opens) the destination copy of a file.
+    HANDLE CreateDestinationFile(const std::wstring& destPath, bool unbuffered) {
+        DWORD access = options.updateInPlace ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE;
+        DWORD disposition = options.updateInPlace ? OPEN_ALWAYS : CREATE_ALWAYS;
+        DWORD flags = unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL;
+        HANDLE hFile = CreateFileW(destPath.c_str(), access, 0, NULL, disposition, flags, NULL);
+        if (hFile == INVALID_HANDLE_VALUE && GetLastError() == ERROR_ACCESS_DENIED) {
+            // An existing read-only, hidden or system copy refuses write access; clear it and retry.
+            SetFileAttributesW(destPath.c_str(), FILE_ATTRIBUTE_NORMAL);
+            hFile = CreateFileW(destPath.c_str(), access, 0, NULL, disposition, flags, NULL);
+        }
+        return hFile;
+    }
+
+    bool OpenDestinationFile(Destination& dest, WriteLane& lane, FileTask& file) {
+        const std::wstring& destPath = ScratchPath(dest.root, file.relPath);
+        lane.parentDir.assign(destPath, 0, destPath.rfind(L'\\'));
+        if (lane.createdDirs.find(lane.parentDir) == lane.createdDirs.end()) {
+            lane.createdDirs.insert(lane.parentDir);
+            std::error_code ec;
+            std::filesystem::create_directories(lane.parentDir, ec);
+        }
+
+        file.destUnbuffered = options.bypassCache;
+        file.destHandle = CreateDestinationFile(destPath, file.destUnbuffered);
+        if (file.destHandle == INVALID_HANDLE_VALUE && file.destUnbuffered && GetLastError() == ERROR_INVALID_PARAMETER) {
+            file.destUnbuffered = false;
+            file.destHandle = CreateDestinationFile(destPath, false);
+        }
+        if (file.destHandle == INVALID_HANDLE_VALUE) {
+            ReportError(BinaryLog::CreateFailed, destPath, GetLastError());
+            return false;
+        }
+        file.destExisted = options.updateInPlace && GetLastError() == ERROR_ALREADY_EXISTS;
+        return true;
+    }
+
+    // Returns true if the destination already holds 'block' at its offset. Reading past the
+    // end of a shorter copy simply counts as a difference.
+    bool BlockUnchanged(Destination& dest, FileTask& file, WriteLane& lane, const Block& block, DWORD length) {
+        OVERLAPPED at = {};
+        at.Offset = static_cast<DWORD>(file.written);
+        at.OffsetHigh = static_cast<DWORD>(file.written >> 32);
+        DWORD bytesRead = 0;
+        return dest.io.Read(file.destHandle, lane.scratch, length, &bytesRead, &at) &&
+            bytesRead >= block.length && memcmp(lane.scratch, block.data, block.length) == 0;
+    }
+
+    // Writes one block at the file's current offset, or skips it in update-in-place mode
+    // when the destination already matches. Unbuffered handles only take sector-multiple
+    // I/O, so a short final block is zero-padded here and the file is cut back to size
+    // once complete.
+    bool WriteBlock(Destination& dest, WriteLane& lane, FileTask& file, const Block& block) {
+        DWORD length = block.length;
+        if (file.destUnbuffered && length % kSectorAlignment) {
+            DWORD padded = (length + kSectorAlignment - 1) / kSectorAlignment * kSectorAlignment;
+            memset(block.data + length, 0, padded - length);
+            length = padded;
+        }
+        if (!file.destExisted || !BlockUnchanged(dest, file, lane, block, length)) {
+            DWORD bytesWritten = 0;
+            bool written = RetryTransientIo([&] {
+                OVERLAPPED at = {};
+                at.Offset = static_cast<DWORD>(file.written);
+                at.OffsetHigh = static_cast<DWORD>(file.written >> 32);
+                return dest.io.Write(file.destHandle, block.data, length, &bytesWritten, &at) != FALSE;
+            });
+            if (!written || bytesWritten != length) {
+                return false;
+            }
+            if (file.destExisted) {
+                dest.bytesRewritten += block.length;    // only blocks of an existing copy count
+            }
+        }
+        file.written += block.length;
+        return true;
+    }
+
+    // Handles one block of a lane: opens the copy on the file's first block, finishes it
+    // on the last, and keeps the destination's write-speed estimate current for
+    // PickDestination().
+    void WriteOneBlock(Destination& dest, WriteLane& lane, const Block& block) {
+        FileTask& file = *block.file;
+        auto start = std::chrono::steady_clock::now();
+
+        if (block.readFailed) {
+            file.failed = true;
+        }
+        if (file.destHandle == INVALID_HANDLE_VALUE && !file.failed && !OpenDestinationFile(dest, lane, file)) {
+            file.failed = true;
+        }
+        if (block.data) {
+            if (!file.failed && !WriteBlock(dest, lane, file, block)) {
+                ReportError(BinaryLog::WriteFailed, dest.root + file.relPath, GetLastError());
+                file.failed = true;
+            }
+            bufferPool->Release(block.data);
+        }
+        if (block.last) {
+            if (file.destHandle != INVALID_HANDLE_VALUE) {
+                // Padding must go, and an updated copy may be longer than the new source.
+                if (!file.failed && ((file.destUnbuffered && file.written % kSectorAlignment) || file.destExisted)) {
+                    FILE_END_OF_FILE_INFO endOfFile;
+                    endOfFile.EndOfFile.QuadPart = static_cast<LONGLONG>(file.written);
+                    if (!SetFileInformationByHandle(file.destHandle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile))) {
+                        ReportError(BinaryLog::SetSizeFailed, dest.root + file.relPath, GetLastError());
+                        file.failed = true;
+                    }
+                }
+                if (!file.failed) {
+                    FILE_BASIC_INFO info = file.basicInfo;
+                    info.FileAttributes &= kCopiedAttributes;
+                    SetFileInformationByHandle(file.destHandle, FileBasicInfo, &info, sizeof(info));
+                }
+                CloseHandle(file.destHandle);
+                file.destHandle = INVALID_HANDLE_VALUE;
+                if (file.failed) {
+                    DeleteFileW(ScratchPath(dest.root, file.relPath).c_str());
+                }
+            }
+            if (file.failed) {
+                filesFailed++;
+            }
+            else {
+                dest.filesWritten++;
+                dest.bytesWritten += file.written;
+                if (!options.catalogPath.empty()) {
+                    lane.catalog.push_back({ lane.catalogText.size(), file.relPath.size(), file.written });
+                    lane.catalogText.append(file.relPath);
+                }
+            }
+        }
+        file.writeMicros += RecordIo(start, dest.ioCount, dest.ioMicros);
+        if (block.last && !file.failed) {
+            TrackFileTime(file);
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ULONGLONG done = block.last ? file.cost : (std::min)(file.cost, static_cast<ULONGLONG>(block.length));
+        file.cost -= done;
+        dest.queuedBytes -= done;
+        completedCost += done;
+        if (seconds > 0) {
+            dest.laneBytesPerSec = dest.laneBytesPerSec.load() * 0.8 + (done / seconds) * 0.2;
+        }
+        if (block.last) {
+            taskPool.Release(&file);
+        }
+    }
+
+    // Writes the blocks of one lane in arrival order, taking whatever has queued up at once.
+    void WriterLoop(Destination& dest, WriteLane& lane) {
+        Block batch[kWriteBatch];
+        for (size_t count; (count = lane.queue.PopBatch(batch, kWriteBatch)) > 0;) {
+            for (size_t i = 0; i < count; ++i) {
+                WriteOneBlock(dest, lane, batch[i]);
+            }
+        }
+    }
+
+public:
+    StripedCopyEngine(const std::wstring& source, const std::vector<std::wstring>& destRoots,
+        const CopyOptions& copyOptions)
+        : sourceRoot(source), options(copyOptions) {
+        if (!sourceRoot.empty() && sourceRoot.back() != L'\\') {
+            sourceRoot += L'\\';
+        }
+        for (const std::wstring& root : destRoots) {
+            auto dest = std::make_unique<Destination>(options.simulateDestination);
+            dest->root = root;
+            if (!dest->root.empty() && dest->root.back() != L'\\') {
+                dest->root += L'\\';
+            }
+            destinations.push_back(std::move(dest));
+        }
+        for (const std::wstring& pattern : options.exclude) {
+            size_t first = pattern.find_first_not_of(L"\\/");
+            size_t last = pattern.find_last_not_of(L"\\/");
+            if (first == std::wstring::npos) {
+                continue;
+            }
+            std::wstring path = pattern.substr(first, last - first + 1);
+            std::replace(path.begin(), path.end(), L'/', L'\\');
+            std::wstring folded;
+            FoldPathCase(path.data(), path.size(), folded);
+            excluded.insert(std::move(folded));
+        }
+    }
+
+    bool Run() {
+        for (auto& dest : destinations) {
+            std::error_code ec;
+            std::filesystem::create_directories(dest->root, ec);
+            ULARGE_INTEGER freeBytes;
+            if (!GetDiskFreeSpaceExW(dest->root.c_str(), &freeBytes, NULL, NULL)) {
+                ReportError(BinaryLog::FreeSpaceFailed, dest->root, GetLastError());
+                return false;
+            }
+            dest->freeBytes = freeBytes.QuadPart;
+            wchar_t volumeRoot[MAX_PATH];
+            wchar_t volumeName[MAX_PATH];
+            if (GetVolumePathNameW(dest->root.c_str(), volumeRoot, MAX_PATH) &&
+                GetVolumeNameForVolumeMountPointW(volumeRoot, volumeName, MAX_PATH)) {
+                destinationVolumes.insert(volumeName);
+            }
+        }
+
+        bufferPool = std::make_unique<BufferPool>(
+            (kMaxReadersPerDevice + destinations.size() * kMaxWriteLanes) * kBuffersPerThread, kBlockSize,
+            options.largePages);
+        std::vector<AdaptiveConcurrency::Knob> knobs{ { L"scan", &scanGate, 1, kMaxScanners } };
+        if (options.updateInPlace) {
+            scratchPool = std::make_unique<BufferPool>(destinations.size() * kMaxWriteLanes, kBlockSize,
+                options.largePages);
+        }
+        summary.largePages = bufferPool->UsesLargePages() && (!scratchPool || scratchPool->UsesLargePages());
+        for (auto& dest : destinations) {
+            for (size_t i = 0; i < kMaxWriteLanes; ++i) {
+                auto lane = std::make_unique<WriteLane>();
+                if (scratchPool) {
+                    lane->scratch = scratchPool->Acquire();
+                }
+                Destination* d = dest.get();
+                WriteLane* l = lane.get();
+                lane->thread = std::thread([this, d, l] { WriterLoop(*d, *l); });
+                dest->lanes.push_back(std::move(lane));
+            }
+            knobs.push_back({ L"write " + dest->root, &dest->writeGate, 1, kMaxWriteLanes });
+        }
+        controller = std::make_unique<AdaptiveConcurrency>(std::move(knobs), completedCost, ioCount, ioMicros);
+        SourceDevice* rootDevice = GetSourceDevice(ResolveSourceDevice(sourceRoot));
+        controller->Start();
+
+        auto start = std::chrono::steady_clock::now();
+#ifdef BACKUP_COUNT_ALLOCATIONS
+        ULONGLONG allocationsAtStart = heapAllocations;
+#endif
+        QueueDirectory(DirTask{ L"", rootDevice });
+        {
+            std::unique_lock<std::mutex> lock(scanMutex);
+            scanDone.wait(lock, [this] { return pendingDirs == 0; });
+        }
+        summary.scanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (auto& device : sourceDevices) {
+            device->queue.Close();
+            device->readGate.Open();
+        }
+        for (auto& device : sourceDevices) {
+            for (auto& reader : device->readers) {
+                reader.join();
+            }
+        }
+        for (auto& dest : destinations) {
+            for (auto& lane : dest->lanes) {
+                lane->queue.Close();
+            }
+            for (auto& lane : dest->lanes) {
+                lane->thread.join();
+            }
+        }
+        controller->Stop();
+        summary.copySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef BACKUP_COUNT_ALLOCATIONS
+        summary.heapAllocations = heapAllocations - allocationsAtStart;
+#endif
+        CreateDirectories();
+        summary.directorySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() -
+            summary.copySeconds;
+
+        const double seconds = summary.copySeconds;
+        auto mbPerSec = [seconds](ULONGLONG bytes) {
+            return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0;
+        };
+        auto msPerIo = [](ULONGLONG count, ULONGLONG micros) {
+            return count ? micros / 1000.0 / count : 0.0;
+        };
+        for (auto& device : sourceDevices) {
+            summary.sources.push_back({ device->name, device->filesRead, device->bytesRead, 0,
+                mbPerSec(device->bytesRead), msPerIo(device->ioCount, device->ioMicros) });
+        }
+        for (auto& dest : destinations) {
+            summary.destinations.push_back({ dest->root, dest->filesWritten, dest->bytesWritten, dest->bytesRewritten,
+                mbPerSec(dest->bytesWritten), msPerIo(dest->ioCount, dest->ioMicros) });
+            summary.files += dest->filesWritten;
+            summary.bytes += dest->bytesWritten;
+        }
+        summary.directories = directories.size();
+        summary.filesFailed = filesFailed;
+        summary.directoriesFailed = directoriesFailed;
+        summary.excluded = excludedEntries;
+        summary.slowestFiles = slowFiles.Slowest();
+        const auto& finalKnobs = controller->Knobs();
+        for (const auto& sample : controller->Trajectory()) {
+            CopySummary::TrajectoryPoint point;
+            point.seconds = sample.seconds;
+            for (size_t i = 0; i < sample.workers.size(); ++i) {
+                point.workers.emplace_back(finalKnobs[i].name, sample.workers[i]);
+            }
+            point.mbPerSec = sample.mbPerSec;
+            point.msPerIo = sample.latencyMs;
+            summary.trajectory.push_back(std::move(point));
+        }
+        summary.scheduler = Scheduler().Snapshot();
+        return filesFailed == 0 && directoriesFailed == 0;
+    }
+
+    const CopySummary& Summary() const {
+        return summary;
+    }
+
+    // The catalog file of everything written, if options.catalogPath was set.
+    std::string BuildCatalog() const {
+        std::vector<std::wstring> roots;
+        std::vector<FileCatalog::Entry> entries;
+        for (size_t i = 0; i < destinations.size(); ++i) {
+            roots.push_back(destinations[i]->root);
+            for (const auto& lane : destinations[i]->lanes) {
+                for (const CatalogRecord& record : lane->catalog) {
+                    entries.push_back({ lane->catalogText.data() + record.offset, record.length,
+                        static_cast<WORD>(i), record.size });
+                }
+            }
+        }
+        return FileCatalog::Build(roots, entries);
+    }
+};
+
+//
+// PrintCopySummary writes the human-readable version of a copy run to the console.
+//
+void PrintCopySummary(const CopySummary& summary, bool updateInPlace) {
+    for (const auto& device : summary.sources) {
+        std::wcout << L"  read " << device.name << L": " << device.files << L" files, "
+            << device.bytes / (1024 * 1024) << L" MB, " << static_cast<ULONGLONG>(device.mbPerSec) << L" MB/s, "
+            << device.msPerIo << L" ms per read\n";
+    }
+    for (const auto& dest : summary.destinations) {
+        std::wcout << L"  write " << dest.name << L": " << dest.files << L" files, "
+            << dest.bytes / (1024 * 1024) << L" MB, " << static_cast<ULONGLONG>(dest.mbPerSec) << L" MB/s, "
+            << dest.msPerIo << L" ms per write";
+        if (updateInPlace) {
+            std::wcout << L", " << dest.bytesRewritten / (1024 * 1024) << L" MB rewritten in place";
+        }
+        std::wcout << L"\n";
+    }
+    double seconds = summary.copySeconds + summary.directorySeconds;
+    std::wcout << L"Copied " << summary.files << L" files (" << summary.bytes / (1024 * 1024) << L" MB) and "
+        << summary.directories << L" directories in " << static_cast<ULONGLONG>(seconds) << L" s ("
+        << static_cast<ULONGLONG>(seconds > 0 ? summary.files / seconds : 0) << L" files/s); "
+        << summary.filesFailed << L" files and " << summary.directoriesFailed << L" directories failed." << std::endl;
+    if (summary.excluded) {
+        std::wcout << L"Excluded " << summary.excluded << L" files and directories.\n";
+    }
+#ifdef BACKUP_COUNT_ALLOCATIONS
+    std::wcout << L"Heap allocations during the copy: " << summary.heapAllocations << L" ("
+        << (summary.files ? static_cast<double>(summary.heapAllocations) / summary.files : 0) << L" per file)\n";
+#endif
+
+    std::wcout << L"Slowest files (s, MB/s, MB, stalled phase, path):\n";
+    for (const auto& entry : summary.slowestFiles) {
+        double entryMbPerSec = entry.seconds > 0 ? entry.size / entry.seconds / (1024 * 1024) : 0;
+        std::wcout << L"  " << entry.seconds << L", " << entryMbPerSec << L", " << entry.size / (1024 * 1024)
+            << L", " << entry.stalledPhase << L" " << entry.phaseSeconds << L" s, " << entry.path << L"\n";
+    }
+
+    std::wcout << L"Worker trajectory (s: active workers, MB/s, ms per I/O):\n";
+    for (const auto& point : summary.trajectory) {
+        std::wcout << L"  " << static_cast<ULONGLONG>(point.seconds) << L":";
+        for (const auto& workers : point.workers) {
+            std::wcout << L" " << workers.first << L"=" << workers.second;
+        }
+        std::wcout << L", " << static_cast<ULONGLONG>(point.mbPerSec) << L", " << point.msPerIo << L"\n";
+    }
+
+    const TaskScheduler::Stats& tasks = summary.scheduler;
+    std::wcout << L"Task scheduler: " << tasks.workers << L" workers, " << tasks.tasksRun[TaskScheduler::High]
+        << L" metadata and " << tasks.tasksRun[TaskScheduler::Normal] << L" bulk tasks, " << tasks.steals
+        << L" steals, " << tasks.blockingScopes << L" blocking waits, peak queue " << tasks.peakQueued
+        << L", " << tasks.idleSeconds << L" s idle\n";
+}
+
 //
 // VSSFileLevelBackup performs a file-level backup (copies files from the shadow copy)
-// using VSS to obtain a consistent snapshot of a given volume.
+// using VSS to obtain a consistent snapshot of a given volume. With more than one
+// destination folder the copy is striped across them (see StripedCopyEngine).
 //
 class VSSFileLevelBackup {
 private:
@@ -31,11 +3245,15 @@ private:
     VSS_ID snapshotSetId = GUID_NULL;
     VSS_ID snapshotId = GUID_NULL;
     std::wstring sourceDrive;
-    std::wstring destFolder;
+    std::vector<std::wstring> destFolders;
+    CopyOptions options;
+    CopySummary copySummary;
+    std::string catalog;
 
 public:
-    VSSFileLevelBackup(const std::wstring& source, const std::wstring& destination)
-        : sourceDrive(source), destFolder(destination) {
+    VSSFileLevelBackup(const std::wstring& source, const std::vector<std::wstring>& destinations,
+        const CopyOptions& copyOptions)
+        : sourceDrive(source), destFolders(destinations), options(copyOptions) {
     }
 
     ~VSSFileLevelBackup() {
@@ -121,18 +3339,19 @@ public:
         std::wstring srcPath = mountPoint + L"\\";
         std::wcout << L"Mounted shadow copy at: " << srcPath << std::endl;
 
-        try {
-            std::filesystem::create_directories(destFolder);
-            std::filesystem::copy(srcPath, destFolder,
-                std::filesystem::copy_options::recursive |
-                std::filesystem::copy_options::overwrite_existing);
-        }
-        catch (const std::filesystem::filesystem_error& ex) {
-            std::cerr << "Filesystem copy error: " << ex.what() << "\n";
-            DefineDosDeviceW(DDD_RAW_TARGET_PATH | DDD_REMOVE_DEFINITION, mountPoint.c_str(), shadowPath.c_str());
-            VssFreeSnapshotProperties(&snapProp);
-            return false;
+        StripedCopyEngine engine(srcPath, destFolders, options);
+        bool copied = engine.Run();
+        copySummary = engine.Summary();
+        if (!options.catalogPath.empty()) {
+            catalog = engine.BuildCatalog();
+            copySummary.catalogBytes = catalog.size();
+        }
+        Log().Flush();
+        if (options.largePages && !copySummary.largePages) {
+            std::wcout << L"Large pages unavailable (the account needs the \"Lock pages in memory\" right); "
+                << L"some or all I/O buffers used normal pages.\n";
         }
+        PrintCopySummary(copySummary, options.updateInPlace);
 
         // Unmap the drive letter.
         if (!DefineDosDeviceW(DDD_RAW_TARGET_PATH | DDD_REMOVE_DEFINITION, mountPoint.c_str(), shadowPath.c_str())) {
@@ -140,7 +3359,15 @@ public:
         }
 
         VssFreeSnapshotProperties(&snapProp);
-        return true;
+        return copied;
+    }
+
+    const CopySummary& GetCopySummary() const {
+        return copySummary;
+    }
+
+    const std::string& GetCatalog() const {
+        return catalog;
     }
 
     bool Cleanup() {
@@ -164,10 +3391,47 @@ public:
     }
 };
 
+//
+// WriteFileAtomically replaces 'path' with 'size' bytes from 'data' so that a crash
+// leaves either the previous file or the complete new one, never a torn mix.
+// The data goes to "<path>.tmp", is flushed to disk, then renamed over the target.
+//
+bool WriteFileAtomically(const std::filesystem::path& path, const void* data, DWORD size) {
+    std::filesystem::path tmpPath = path;
+    tmpPath += L".tmp";
+
+    HANDLE hFile = CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        std::wcerr << L"Failed to open " << tmpPath.wstring() << L" for writing (error=0x"
+            << std::hex << GetLastError() << L")\n";
+        return false;
+    }
+
+    DWORD bytesWritten = 0;
+    if (!WriteFile(hFile, data, size, &bytesWritten, NULL) || bytesWritten != size ||
+        !FlushFileBuffers(hFile)) {
+        std::wcerr << L"Failed to write " << tmpPath.wstring() << L" (error=0x"
+            << std::hex << GetLastError() << L")\n";
+        CloseHandle(hFile);
+        DeleteFileW(tmpPath.c_str());
+        return false;
+    }
+    CloseHandle(hFile);
+
+    if (!MoveFileExW(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        std::wcerr << L"Failed to replace " << path.wstring() << L" (error=0x"
+            << std::hex << GetLastError() << L")\n";
+        DeleteFileW(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
 //
 // CapturePhysicalDriveMetadata reads low-level disk metadata from a specified physical drive.
 // It captures a boot record (first 4KB) and the drive's partition layout using IOCTL_DISK_GET_DRIVE_LAYOUT_EX.
-// Both results are written as binary files in the destination folder.
+// Both results are written as binary files in the destination folder, each replaced atomically.
 //
 bool CapturePhysicalDriveMetadata(int driveNumber, const std::wstring& destFolder) {
     // Build the physical drive path: "\\.\PhysicalDriveX"
@@ -192,22 +3456,11 @@ bool CapturePhysicalDriveMetadata(int driveNumber, const std::wstring& destFolde
 
     // Write the boot record to a file in the destination folder.
     std::filesystem::path bootPath = std::filesystem::path(destFolder) / L"boot_record.bin";
-    try {
-        std::ofstream bootFile(bootPath, std::ios::binary);
-        if (!bootFile) {
-            std::wcerr << L"Failed to open " << bootPath.wstring() << L" for writing.\n";
-            CloseHandle(hDrive);
-            return false;
-        }
-        bootFile.write(reinterpret_cast<char*>(bootRecord.get()), bytesRead);
-        bootFile.close();
-        std::wcout << L"Boot record (" << bytesRead << L" bytes) written to " << bootPath.wstring() << std::endl;
-    }
-    catch (const std::exception& ex) {
-        std::wcerr << L"Exception writing boot record: " << ex.what() << std::endl;
+    if (!WriteFileAtomically(bootPath, bootRecord.get(), bytesRead)) {
         CloseHandle(hDrive);
         return false;
     }
+    std::wcout << L"Boot record (" << bytesRead << L" bytes) written to " << bootPath.wstring() << std::endl;
 
     // Get the drive layout information.
     DWORD outSize = sizeof(DRIVE_LAYOUT_INFORMATION_EX) + 128 * sizeof(PARTITION_INFORMATION_EX);
@@ -223,27 +3476,492 @@ bool CapturePhysicalDriveMetadata(int driveNumber, const std::wstring& destFolde
 
     // Write the raw drive layout info to a binary file.
     std::filesystem::path layoutPath = std::filesystem::path(destFolder) / L"drive_layout.bin";
-    try {
-        std::ofstream layoutFile(layoutPath, std::ios::binary);
-        if (!layoutFile) {
-            std::wcerr << L"Failed to open " << layoutPath.wstring() << L" for writing.\n";
-            CloseHandle(hDrive);
-            return false;
-        }
-        layoutFile.write(reinterpret_cast<char*>(layoutBuffer.get()), bytesReturned);
-        layoutFile.close();
-        std::wcout << L"Drive layout (" << bytesReturned << L" bytes) written to " << layoutPath.wstring() << std::endl;
-    }
-    catch (const std::exception& ex) {
-        std::wcerr << L"Exception writing drive layout: " << ex.what() << std::endl;
+    if (!WriteFileAtomically(layoutPath, layoutBuffer.get(), bytesReturned)) {
         CloseHandle(hDrive);
         return false;
     }
+    std::wcout << L"Drive layout (" << bytesReturned << L" bytes) written to " << layoutPath.wstring() << std::endl;
 
     CloseHandle(hDrive);
     return true;
 }
 
+//
+// ToUtf8 converts a UTF-16 string (paths, device names) for the JSON run report.
+//
+std::string ToUtf8(const std::wstring& text) {
+    std::string utf8;
+    AppendUtf8(text.data(), text.size(), utf8);
+    return utf8;
+}
+
+//
+// JsonWriter builds an indented JSON document in memory. Keys are ignored (pass "")
+// for values inside arrays.
+//
+class JsonWriter {
+private:
+    std::string out;
+    std::vector<bool> hasItems;
+
+    void AppendString(const std::string& text) {
+        out += '"';
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else {
+                out += static_cast<char>(c);
+            }
+        }
+        out += '"';
+    }
+
+    void Prefix(const std::string& key) {
+        if (!hasItems.empty()) {
+            out += hasItems.back() ? ",\n" : "\n";
+            hasItems.back() = true;
+            out.append(hasItems.size() * 2, ' ');
+            if (!key.empty()) {
+                AppendString(key);
+                out += ": ";
+            }
+        }
+    }
+
+    void Close(char bracket) {
+        bool hadItems = hasItems.back();
+        hasItems.pop_back();
+        if (hadItems) {
+            out += '\n';
+            out.append(hasItems.size() * 2, ' ');
+        }
+        out += bracket;
+    }
+
+public:
+    void BeginObject(const std::string& key = "") {
+        Prefix(key);
+        out += '{';
+        hasItems.push_back(false);
+    }
+
+    void EndObject() {
+        Close('}');
+    }
+
+    void BeginArray(const std::string& key = "") {
+        Prefix(key);
+        out += '[';
+        hasItems.push_back(false);
+    }
+
+    void EndArray() {
+        Close(']');
+    }
+
+    void String(const std::string& key, const std::wstring& value) {
+        Prefix(key);
+        AppendString(ToUtf8(value));
+    }
+
+    void String(const std::string& key, const char* value) {
+        Prefix(key);
+        AppendString(value);
+    }
+
+    void Number(const std::string& key, double value) {
+        Prefix(key);
+        char text[32];
+        snprintf(text, sizeof(text), "%.10g", std::isfinite(value) ? value : 0.0);
+        out += text;
+    }
+
+    void Integer(const std::string& key, ULONGLONG value) {
+        Prefix(key);
+        out += std::to_string(value);
+    }
+
+    void Bool(const std::string& key, bool value) {
+        Prefix(key);
+        out += value ? "true" : "false";
+    }
+
+    const std::string& Text() const {
+        return out;
+    }
+};
+
+//
+// RunReport times the phases of a backup run and writes them, together with the
+// configuration, copy statistics and process resource usage, as a JSON document that
+// later runs can be compared against (see CompareReports).
+//
+class RunReport {
+private:
+    struct Phase {
+        std::string name;
+        double seconds;
+        bool ok;
+    };
+
+    std::vector<Phase> phases;
+    std::string started;
+
+    static double FileTimeSeconds(const FILETIME& time) {
+        return ((static_cast<ULONGLONG>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+    }
+
+    void WriteDevices(JsonWriter& json, const char* key, const std::vector<CopySummary::DeviceStats>& devices) {
+        json.BeginObject(key);
+        for (const auto& device : devices) {
+            json.BeginObject(ToUtf8(device.name));
+            json.Integer("files", device.files);
+            json.Integer("bytes", device.bytes);
+            json.Integer("bytes_rewritten", device.bytesRewritten);
+            json.Number("mb_per_sec", device.mbPerSec);
+            json.Number("ms_per_io", device.msPerIo);
+            json.EndObject();
+        }
+        json.EndObject();
+    }
+
+public:
+    RunReport() {
+        SYSTEMTIME now;
+        GetSystemTime(&now);
+        char text[32];
+        snprintf(text, sizeof(text), "%04u-%02u-%02uT%02u:%02u:%02uZ", now.wYear, now.wMonth, now.wDay,
+            now.wHour, now.wMinute, now.wSecond);
+        started = text;
+    }
+
+    // Runs one phase of the backup and records how long it took and whether it succeeded.
+    template <typename Step>
+    bool TimePhase(const char* name, Step step) {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = step();
+        phases.push_back({ name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), ok });
+        return ok;
+    }
+
+    bool Write(const std::filesystem::path& path, const std::wstring& volume,
+        const std::vector<std::wstring>& destinations, int driveNumber, const CopyOptions& options,
+        const CopySummary& copy, bool success) {
+        JsonWriter json;
+        json.BeginObject();
+        json.String("tool", "system_backup");
+        json.String("started", started.c_str());
+        json.Bool("success", success);
+
+        json.BeginObject("config");
+        json.String("volume", volume);
+        json.BeginArray("destinations");
+        for (const auto& dest : destinations) {
+            json.String("", dest);
+        }
+        json.EndArray();
+        json.Integer("drive_number", static_cast<ULONGLONG>(driveNumber));
+        json.Bool("bypass_cache", options.bypassCache);
+        json.Bool("update_in_place", options.updateInPlace);
+        json.Bool("large_pages", options.largePages);
+        json.Bool("follow_mounts", options.followMounts);
+        json.String("catalog", options.catalogPath);
+        json.BeginArray("exclude");
+        for (const auto& pattern : options.exclude) {
+            json.String("", pattern);
+        }
+        json.EndArray();
+        json.String("simulate_source", options.simulateSource.name);
+        json.String("simulate_destination", options.simulateDestination.name);
+        json.EndObject();
+
+        // The copy engine's stages overlap (scanning runs while files are copied), so they
+        // are reported after the top-level phases rather than summed with them.
+        json.BeginObject("phases");
+        for (const auto& phase : phases) {
+            json.BeginObject(phase.name);
+            json.Number("seconds", phase.seconds);
+            json.Bool("ok", phase.ok);
+            json.EndObject();
+        }
+        json.BeginObject("copy.scan");
+        json.Number("seconds", copy.scanSeconds);
+        json.EndObject();
+        json.BeginObject("copy.transfer");
+        json.Number("seconds", copy.copySeconds);
+        json.EndObject();
+        json.BeginObject("copy.directory_metadata");
+        json.Number("seconds", copy.directorySeconds);
+        json.EndObject();
+        json.EndObject();
+
+        double copySeconds = copy.copySeconds + copy.directorySeconds;
+        json.BeginObject("copy");
+        json.Integer("files", copy.files);
+        json.Integer("bytes", copy.bytes);
+        json.Integer("directories", copy.directories);
+        json.Integer("files_failed", copy.filesFailed);
+        json.Integer("directories_failed", copy.directoriesFailed);
+        json.Integer("excluded", copy.excluded);
+        json.Number("mb_per_sec", copySeconds > 0 ? copy.bytes / copySeconds / (1024 * 1024) : 0);
+        json.Number("files_per_sec", copySeconds > 0 ? copy.files / copySeconds : 0);
+        json.Bool("large_pages_used", copy.largePages);
+        json.Integer("catalog_bytes", copy.catalogBytes);
+#ifdef BACKUP_COUNT_ALLOCATIONS
+        json.Integer("heap_allocations", copy.heapAllocations);
+        json.Number("allocations_per_file", copy.files ? static_cast<double>(copy.heapAllocations) / copy.files : 0);
+#endif
+        WriteDevices(json, "sources", copy.sources);
+        WriteDevices(json, "destinations", copy.destinations);
+        json.BeginArray("slowest_files");
+        for (const auto& entry : copy.slowestFiles) {
+            json.BeginObject();
+            json.String("path", entry.path);
+            json.Integer("bytes", entry.size);
+            json.Number("seconds", entry.seconds);
+            json.String("stalled_phase", entry.stalledPhase);
+            json.Number("stalled_seconds", entry.phaseSeconds);
+            json.EndObject();
+        }
+        json.EndArray();
+        json.BeginArray("worker_trajectory");
+        for (const auto& point : copy.trajectory) {
+            json.BeginObject();
+            json.Number("seconds", point.seconds);
+            json.BeginObject("workers");
+            for (const auto& workers : point.workers) {
+                json.Integer(ToUtf8(workers.first), workers.second);
+            }
+            json.EndObject();
+            json.Number("mb_per_sec", point.mbPerSec);
+            json.Number("ms_per_io", point.msPerIo);
+            json.EndObject();
+        }
+        json.EndArray();
+        json.EndObject();
+
+        json.BeginObject("scheduler");
+        json.Integer("workers", copy.scheduler.workers);
+        json.Integer("high_priority_tasks", copy.scheduler.tasksRun[TaskScheduler::High]);
+        json.Integer("normal_priority_tasks", copy.scheduler.tasksRun[TaskScheduler::Normal]);
+        json.Integer("steals", copy.scheduler.steals);
+        json.Integer("blocking_scopes", copy.scheduler.blockingScopes);
+        json.Integer("peak_queued", copy.scheduler.peakQueued);
+        json.Number("idle_ms", copy.scheduler.idleSeconds * 1000);
+        json.EndObject();
+
+        json.BeginObject("resources");
+        FILETIME created, exited, kernel, user;
+        if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+            json.Number("cpu_user_seconds", FileTimeSeconds(user));
+            json.Number("cpu_kernel_seconds", FileTimeSeconds(kernel));
+        }
+        PROCESS_MEMORY_COUNTERS memory = {};
+        memory.cb = sizeof(memory);
+        if (K32GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+            json.Number("peak_working_set_mb", memory.PeakWorkingSetSize / (1024.0 * 1024));
+        }
+        IO_COUNTERS io;
+        if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+            json.Integer("read_bytes", io.ReadTransferCount);
+            json.Integer("write_bytes", io.WriteTransferCount);
+        }
+        json.EndObject();
+        json.EndObject();
+
+        std::string text = json.Text() + "\n";
+        return WriteFileAtomically(path, text.data(), static_cast<DWORD>(text.size()));
+    }
+};
+
+//
+// JsonFlattener parses a JSON document and collects every numeric or boolean leaf
+// under its dotted path, e.g. "phases.snapshot.seconds" or "copy.mb_per_sec".
+// Array elements are addressed by index. Strings and nulls are skipped.
+//
+class JsonFlattener {
+private:
+    const std::string& text;
+    size_t pos = 0;
+    std::map<std::string, double>& values;
+
+    void SkipSpace() {
+        while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) {
+            ++pos;
+        }
+    }
+
+    bool Consume(char c) {
+        SkipSpace();
+        if (pos < text.size() && text[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool ParseString(std::string& out) {
+        if (!Consume('"')) {
+            return false;
+        }
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] == '\\' && pos + 1 < text.size()) {
+                ++pos;
+                // Escapes only matter for key identity, so \uXXXX is kept verbatim.
+                if (text[pos] == 'u') {
+                    out += "\\u";
+                    ++pos;
+                    continue;
+                }
+            }
+            out += text[pos++];
+        }
+        return Consume('"');
+    }
+
+    bool ParseValue(const std::string& path) {
+        SkipSpace();
+        if (pos >= text.size()) {
+            return false;
+        }
+        char c = text[pos];
+        if (c == '{') {
+            ++pos;
+            if (Consume('}')) {
+                return true;
+            }
+            do {
+                std::string key;
+                if (!ParseString(key) || !Consume(':') || !ParseValue(path.empty() ? key : path + "." + key)) {
+                    return false;
+                }
+            } while (Consume(','));
+            return Consume('}');
+        }
+        if (c == '[') {
+            ++pos;
+            if (Consume(']')) {
+                return true;
+            }
+            size_t index = 0;
+            do {
+                if (!ParseValue(path + "[" + std::to_string(index++) + "]")) {
+                    return false;
+                }
+            } while (Consume(','));
+            return Consume(']');
+        }
+        if (c == '"') {
+            std::string ignored;
+            return ParseString(ignored);
+        }
+        if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 4, "null") == 0) {
+            if (text[pos] == 't') {
+                values[path] = 1;
+            }
+            pos += 4;
+            return true;
+        }
+        if (text.compare(pos, 5, "false") == 0) {
+            values[path] = 0;
+            pos += 5;
+            return true;
+        }
+        char* end = nullptr;
+        double number = strtod(text.c_str() + pos, &end);
+        if (end == text.c_str() + pos) {
+            return false;
+        }
+        values[path] = number;
+        pos = static_cast<size_t>(end - text.c_str());
+        return true;
+    }
+
+public:
+    JsonFlattener(const std::string& document, std::map<std::string, double>& leaves)
+        : text(document), values(leaves) {
+    }
+
+    bool Parse() {
+        return ParseValue("") && (SkipSpace(), pos == text.size());
+    }
+};
+
+//
+// CompareReports loads two run reports and flags every metric that got worse by more
+// than thresholdPercent: longer phases, higher latency, more failures or memory, and
+// lower throughput. Returns the process exit code (0 = no regressions).
+//
+int CompareReports(const std::wstring& baselinePath, const std::wstring& currentPath, double thresholdPercent) {
+    std::map<std::string, double> baseline;
+    std::map<std::string, double> current;
+    for (auto [path, values] : { std::make_pair(&baselinePath, &baseline), std::make_pair(&currentPath, &current) }) {
+        std::ifstream file(std::filesystem::path(*path), std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof()) {
+            text.clear();
+        }
+        if (text.empty() || !JsonFlattener(text, *values).Parse()) {
+            std::wcerr << L"Failed to read run report " << *path << L"\n";
+            return 2;
+        }
+    }
+
+    auto endsWith = [](const std::string& key, const char* suffix) {
+        size_t length = strlen(suffix);
+        return key.size() >= length && key.compare(key.size() - length, length, suffix) == 0;
+    };
+    size_t regressions = 0;
+    for (const auto& entry : current) {
+        const std::string& key = entry.first;
+        auto base = baseline.find(key);
+        // Per-file and per-window samples differ from run to run by nature.
+        if (base == baseline.end() || key.find("slowest_files") != std::string::npos ||
+            key.find("worker_trajectory") != std::string::npos) {
+            continue;
+        }
+        double before = base->second;
+        double after = entry.second;
+        bool regressed = false;
+        if (key == "success" || endsWith(key, ".ok")) {
+            regressed = before > after;
+        }
+        else if (endsWith(key, "_failed")) {
+            regressed = after > before;
+        }
+        else if (endsWith(key, "seconds") || endsWith(key, "ms_per_io") || endsWith(key, "peak_working_set_mb")) {
+            // Sub-second phases are dominated by noise.
+            regressed = (std::max)(before, after) >= 1.0 && after > before * (1 + thresholdPercent / 100);
+        }
+        else if (endsWith(key, "allocations_per_file")) {
+            // The copy path should not allocate at all; under one per file is within noise.
+            regressed = after >= 1.0 && after > before * (1 + thresholdPercent / 100);
+        }
+        else if (endsWith(key, "mb_per_sec") || endsWith(key, "files_per_sec")) {
+            regressed = before > 0 && after < before * (1 - thresholdPercent / 100);
+        }
+        if (regressed) {
+            double change = before != 0 ? (after - before) / before * 100 : 100;
+            std::cout << "REGRESSION " << key << ": " << before << " -> " << after
+                << " (" << (change >= 0 ? "+" : "") << change << "%)\n";
+            regressions++;
+        }
+    }
+    if (regressions == 0) {
+        std::cout << "No regressions above " << thresholdPercent << "%.\n";
+        return 0;
+    }
+    std::cout << regressions << " regression(s) above " << thresholdPercent << "%.\n";
+    return 1;
+}
+
 //
 // Simple helper to check if drive letter Z is available.
 // Returns true if not present in GetLogicalDrives bitmask.
@@ -280,14 +3998,130 @@ static bool IsRunningAsAdmin() {
 //
 // Main: Performs a VSS file-level backup and captures disk metadata.
 //
-int wmain() {
-    if (!IsRunningAsAdmin()) {
-        std::wcerr << L"This program requires administrator privileges.\n";
-        return 1;
+int wmain(int argc, wchar_t* argv[]) {
+    CopyOptions options;
+    std::wstring reportPath;
+    std::wstring logPath;
+    std::wstring compareBaseline;
+    std::wstring compareCurrent;
+    double thresholdPercent = 10;
+    for (int i = 1; i < argc; ++i) {
+        std::wstring arg = argv[i];
+        if (arg == L"--cached-io") {
+            options.bypassCache = false;
+        }
+        else if (arg == L"--update-in-place") {
+            options.updateInPlace = true;
+        }
+        else if (arg == L"--large-pages") {
+            options.largePages = true;
+        }
+        else if (arg == L"--follow-mounts") {
+            options.followMounts = true;
+        }
+        else if (arg == L"--catalog" && i + 1 < argc) {
+            options.catalogPath = argv[++i];
+        }
+        else if (arg == L"--list-catalog" && i + 1 < argc) {
+            return FileCatalog::List(argv[i + 1], i + 2 < argc ? argv[i + 2] : L"");
+        }
+        else if (arg == L"--exclude" && i + 1 < argc) {
+            options.exclude.push_back(argv[++i]);
+        }
+        else if (arg == L"--simulate-source" && i + 1 < argc && ParseDeviceProfile(argv[i + 1], options.simulateSource)) {
+            ++i;
+        }
+        else if (arg == L"--simulate-dest" && i + 1 < argc && ParseDeviceProfile(argv[i + 1], options.simulateDestination)) {
+            ++i;
+        }
+        else if (arg == L"--report" && i + 1 < argc) {
+            reportPath = argv[++i];
+        }
+        else if (arg == L"--log" && i + 1 < argc) {
+            logPath = argv[++i];
+        }
+        else if (arg == L"--decode-log" && i + 1 < argc) {
+            return BinaryLog::Decode(argv[i + 1]);
+        }
+        else if (arg == L"--compare" && i + 2 < argc) {
+            compareBaseline = argv[++i];
+            compareCurrent = argv[++i];
+        }
+        else if (arg == L"--threshold" && i + 1 < argc) {
+            thresholdPercent = std::wcstod(argv[++i], nullptr);
+        }
+        else {
+            std::wcerr << L"Unknown option: " << arg << L"\n"
+                << L"Usage: system_backup [--cached-io] [--update-in-place] [--large-pages] [--report <file>] [--log <file>]\n"
+                << L"                     [--exclude <name or path>]... [--catalog <file>] [--follow-mounts]\n"
+                << L"                     [--simulate-source <profile>] [--simulate-dest <profile>]\n"
+                << L"       system_backup --decode-log <file>\n"
+                << L"       system_backup --list-catalog <file> [<file or directory>]\n"
+                << L"       system_backup --compare <baseline.json> <current.json> [--threshold <percent>]\n"
+                << L"  --cached-io        read and write through the OS file cache\n"
+                << L"  --update-in-place  rewrite only the blocks that differ from the existing copy\n"
+                << L"  --large-pages      put the I/O buffers on large pages (needs the \"Lock pages in memory\" right)\n"
+                << L"  --exclude          skip files and directories with this name, or this path under the volume root\n"
+                << L"                     (case-insensitive; may be repeated, e.g. --exclude pagefile.sys)\n"
+                << L"  --follow-mounts    also copy volumes mounted under the source; they are not snapshotted and are\n"
+                << L"                     copied live\n"
+                << L"  --catalog          write a catalog of every copied file and the destination holding it\n"
+                << L"  --list-catalog     look up a file in a catalog, or list the files below a directory (default: all);\n"
+                << L"                     names match ignoring case\n"
+                << L"  --simulate-source  make every source device behave like <profile> (for pipeline testing)\n"
+                << L"  --simulate-dest    make every destination device behave like <profile>\n"
+                << L"                     profiles: usb, san, flaky, or latency_ms:jitter_ms:mb_per_sec:error_percent\n"
+                << L"  --report           where to write the JSON run report (default: <primary destination>\\backup_report.json)\n"
+                << L"  --log              where to write the binary diagnostics log (default: <primary destination>\\backup_log.bin)\n"
+                << L"  --decode-log       print a binary diagnostics log as text\n"
+                << L"  --compare          list metrics of the current report that regressed against the baseline\n"
+                << L"  --threshold        percentage change counted as a regression (default: 10)\n";
+            return 1;
+        }
+    }
+
+    // Comparing reports does not touch any volume, so it needs no elevation.
+    if (!compareBaseline.empty()) {
+        return CompareReports(compareBaseline, compareCurrent, thresholdPercent);
+    }
+
+    for (const DeviceProfile* profile : { &options.simulateSource, &options.simulateDestination }) {
+        if (profile->Enabled()) {
+            std::wcout << L"Simulating " << (profile == &options.simulateSource ? L"source" : L"destination")
+                << L" devices as '" << profile->name << L"': timings do not reflect the real hardware.\n";
+        }
     }
 
+    // Every run ends through finish(), so a failed run still leaves a report with the
+    // phases it got through. Before the destinations are known, only an explicit
+    // --report path can be written.
+    RunReport report;
     std::wstring volume;
     std::wstring destFolder;
+    std::vector<std::wstring> destFolders;
+    int driveNumber = 0;
+    auto finish = [&](bool success, const CopySummary& copy) {
+        if (reportPath.empty() && !destFolder.empty()) {
+            reportPath = (std::filesystem::path(destFolder) / L"backup_report.json").wstring();
+        }
+        if (!reportPath.empty()) {
+            if (report.Write(reportPath, volume, destFolders, driveNumber, options, copy, success)) {
+                std::wcout << L"Run report written to " << reportPath << L"\n";
+            }
+            else {
+                std::wcerr << L"Failed to write run report " << reportPath << L"\n";
+            }
+        }
+        Log().Stop();
+        std::cout << (success ? "Backup finished.\n" : "Backup finished with errors.\n");
+        return success ? 0 : 1;
+    };
+
+    if (!IsRunningAsAdmin()) {
+        std::wcerr << L"This program requires administrator privileges.\n";
+        return finish(false, CopySummary());
+    }
+
     std::wstring driveNumStr;
 
     std::wcout << L"Enter volume to snapshot (e.g., C:\\): ";
@@ -296,16 +4130,29 @@ int wmain() {
         volume = L"C:\\";
     }
 
-    std::wcout << L"Enter destination folder for backup (e.g., D:\\Backup\\SystemImage): ";
+    std::wcout << L"Enter destination folder(s) for backup, separated by ';' (e.g., D:\\Backup\\SystemImage;E:\\Backup): ";
     std::getline(std::wcin, destFolder);
-    if (destFolder.empty()) {
+    size_t start = 0;
+    while (start <= destFolder.size()) {
+        size_t end = destFolder.find(L';', start);
+        if (end == std::wstring::npos) {
+            end = destFolder.size();
+        }
+        if (end > start) {
+            destFolders.push_back(destFolder.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    if (destFolders.empty()) {
         std::wcerr << L"No destination folder provided.\n";
-        return 1;
+        destFolder.clear();
+        return finish(false, CopySummary());
     }
+    // Drive metadata goes to the first (primary) destination.
+    destFolder = destFolders[0];
 
     std::wcout << L"Enter physical drive number for metadata capture (e.g., 0 for \\\\.\\PhysicalDrive0): ";
     std::getline(std::wcin, driveNumStr);
-    int driveNumber = 0;
     if (!driveNumStr.empty()) {
         try {
             driveNumber = std::stoi(driveNumStr);
@@ -319,38 +4166,60 @@ int wmain() {
     // Check that drive letter Z is available for our VSS mount.
     if (!isDriveLetterAvailable(L'Z')) {
         std::wcerr << L"Drive letter Z is in use. Please free it or choose a different letter.\n";
-        return 1;
+        return finish(false, CopySummary());
+    }
+
+    if (logPath.empty()) {
+        logPath = (std::filesystem::path(destFolder) / L"backup_log.bin").wstring();
     }
+    Log().Start(logPath);
 
-    // Perform VSS file-level backup.
-    VSSFileLevelBackup backup(volume, destFolder);
-    if (!backup.Initialize()) {
+    // Perform VSS file-level backup. Each phase is timed for the run report.
+    VSSFileLevelBackup backup(volume, destFolders, options);
+    if (!report.TimePhase("com_init", [&] { return backup.Initialize(); })) {
         std::cerr << "VSS Initialization failed.\n";
-        return 1;
+        return finish(false, backup.GetCopySummary());
     }
 
     std::cout << "Creating VSS snapshot...\n";
-    if (!backup.CreateSnapshot()) {
+    if (!report.TimePhase("snapshot", [&] { return backup.CreateSnapshot(); })) {
         std::cerr << "CreateSnapshot failed.\n";
-        return 1;
+        return finish(false, backup.GetCopySummary());
     }
 
+    bool success = true;
     std::cout << "Performing file-level backup...\n";
-    if (!backup.FileLevelBackup()) {
+    if (!report.TimePhase("file_level_backup", [&] { return backup.FileLevelBackup(); })) {
         std::cerr << "FileLevelBackup failed.\n";
+        success = false;
+    }
+
+    const std::string& catalog = backup.GetCatalog();
+    if (!options.catalogPath.empty()) {
+        if (report.TimePhase("catalog", [&] {
+                return catalog.size() <= MAXDWORD &&
+                    WriteFileAtomically(options.catalogPath, catalog.data(), static_cast<DWORD>(catalog.size()));
+            })) {
+            std::wcout << L"File catalog (" << catalog.size() / 1024 << L" KB) written to " << options.catalogPath << L"\n";
+        }
+        else {
+            std::wcerr << L"Failed to write file catalog " << options.catalogPath << L"\n";
+            success = false;
+        }
     }
 
     std::cout << "Cleaning up VSS snapshot...\n";
-    if (!backup.Cleanup()) {
+    if (!report.TimePhase("cleanup", [&] { return backup.Cleanup(); })) {
         std::cerr << "BackupComplete failed.\n";
+        success = false;
     }
 
     // Capture additional disk metadata (boot record and partition layout)
     std::cout << "Capturing physical drive metadata...\n";
-    if (!CapturePhysicalDriveMetadata(driveNumber, destFolder)) {
+    if (!report.TimePhase("metadata_capture", [&] { return CapturePhysicalDriveMetadata(driveNumber, destFolder); })) {
         std::cerr << "Physical drive metadata capture failed.\n";
+        success = false;
     }
 
-    std::cout << "Backup finished.\n";
-    return 0;
+    return finish(success, backup.GetCopySummary());
 }
@@ -0,0 +1,74 @@
+//
+// Checks that the copy engine allocates nothing per file once it is warm: the heap
+// allocations of copying a tree grow with its directories and the run's length, not with
+// its file count. Copies a small and a large fixture tree with the same directories and
+// fails if the extra files of the large one cost more than kMaxPerFile allocations each.
+// Build from the repository root and run (no administrator rights needed):
+//
+//   g++ -std=c++17 -O2 -DBACKUP_COUNT_ALLOCATIONS tests/allocation_check.cpp -o allocation_check.exe -lvssapi -lsynchronization
+//   allocation_check.exe
+//
+#define wmain BackupMain
+#include "../system_backup.cpp"
+#undef wmain
+
+namespace {
+
+constexpr size_t kDirectories = 16;
+constexpr size_t kSmallFilesPerDirectory = 320;     // 5120 files, more than a read queue holds
+constexpr size_t kLargeFilesPerDirectory = 640;
+constexpr double kMaxPerFile = 0.01;
+
+void CreateFixture(const std::filesystem::path& root, size_t filesPerDirectory) {
+    const std::string content(100, 'x');
+    for (size_t d = 0; d < kDirectories; ++d) {
+        std::filesystem::path dir = root / (L"dir" + std::to_wstring(d));
+        std::filesystem::create_directories(dir);
+        for (size_t f = 0; f < filesPerDirectory; ++f) {
+            std::ofstream(dir / (L"file" + std::to_wstring(f) + L".dat"), std::ios::binary) << content;
+        }
+    }
+}
+
+// Copies source into a fresh destination and returns the summary.
+CopySummary Copy(const std::filesystem::path& source, const std::filesystem::path& destination) {
+    std::error_code ec;
+    std::filesystem::remove_all(destination, ec);
+    StripedCopyEngine engine(source.wstring(), { destination.wstring() }, CopyOptions());
+    if (!engine.Run()) {
+        std::wcerr << L"Copy of " << source.wstring() << L" failed\n";
+        std::exit(2);
+    }
+    return engine.Summary();
+}
+
+}
+
+int main() {
+    std::filesystem::path root = std::filesystem::temp_directory_path() / L"backup_allocation_check";
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+    CreateFixture(root / L"small", kSmallFilesPerDirectory);
+    CreateFixture(root / L"large", kLargeFilesPerDirectory);
+
+    Copy(root / L"small", root / L"copy");     // warms the scheduler, log rings and thread buffers
+    CopySummary small = Copy(root / L"small", root / L"copy");
+    CopySummary large = Copy(root / L"large", root / L"copy");
+    std::filesystem::remove_all(root, ec);
+
+    if (small.filesFailed || large.filesFailed ||
+        small.files != kDirectories * kSmallFilesPerDirectory || large.files != kDirectories * kLargeFilesPerDirectory) {
+        std::wcerr << L"Fixture not copied completely\n";
+        return 2;
+    }
+    double perFile = (static_cast<double>(large.heapAllocations) - static_cast<double>(small.heapAllocations)) /
+        static_cast<double>(large.files - small.files);
+    std::wcout << L"Heap allocations: " << small.heapAllocations << L" for " << small.files << L" files, "
+        << large.heapAllocations << L" for " << large.files << L" files (" << perFile << L" per extra file)\n";
+    if (perFile > kMaxPerFile) {
+        std::wcerr << L"FAILED: the copy path allocates per file\n";
+        return 1;
+    }
+    std::wcout << L"OK\n";
+    return 0;
+}
@@ -0,0 +1,108 @@
+//
+// Checks that the SSE2 path text helpers produce exactly what their scalar forms do, and
+// that AppendUtf8 matches WideCharToMultiByte. Inputs are random UTF-16 strings heavy in
+// the cases the vector code skips over: non-ASCII units, surrogate pairs and unpaired
+// surrogates, placed at every offset around the 8-unit block boundaries. Build from the
+// repository root and run:
+//
+//   g++ -std=c++17 -O2 tests/path_text_check.cpp -o path_text_check.exe -lvssapi -lsynchronization
+//   path_text_check.exe
+//
+#define wmain BackupMain
+#include "../system_backup.cpp"
+#undef wmain
+
+namespace {
+
+const wchar_t kSpecialUnits[] = { 0x7F, 0x80, 0xE9, 0x7FF, 0x800, 0x20AC, 0xD800, 0xDBFF, 0xDC00, 0xDFFF, 0xFFFD, 0xFFFF };
+
+std::string ReferenceUtf8(const std::wstring& text) {
+    std::string out(text.size() * 3, '\0');
+    int bytes = text.empty() ? 0 : WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()),
+        &out[0], static_cast<int>(out.size()), NULL, NULL);
+    out.resize(static_cast<size_t>(bytes));
+    return out;
+}
+
+void PrintUnits(const std::wstring& text) {
+    for (wchar_t unit : text) {
+        std::printf(" %04X", static_cast<unsigned int>(unit));
+    }
+    std::printf("\n");
+}
+
+// Returns true if every helper agrees on text; prints it otherwise.
+bool Agree(const std::wstring& text) {
+    std::string fast = "prefix";
+    std::string scalar = "prefix";
+    AppendUtf8(text.data(), text.size(), fast);
+    AppendUtf8Scalar(text.data(), text.size(), scalar);
+    std::wstring folded;
+    std::wstring foldedScalar;
+    FoldPathCase(text.data(), text.size(), folded);
+    FoldPathCaseScalar(text.data(), text.size(), foldedScalar);
+    if (fast == scalar && fast == "prefix" + ReferenceUtf8(text) && folded == foldedScalar) {
+        return true;
+    }
+    std::printf("mismatch for");
+    PrintUnits(text);
+    return false;
+}
+
+wchar_t RandomUnit(std::mt19937& random) {
+    unsigned int kind = random() % 100;
+    if (kind < 70) {
+        return static_cast<wchar_t>(0x20 + random() % 0x5F);
+    }
+    if (kind < 80) {
+        return static_cast<wchar_t>(0x80 + random() % 0x780);
+    }
+    if (kind < 90) {
+        return static_cast<wchar_t>(0xD800 + random() % 0x800);
+    }
+    if (kind < 95) {
+        return kSpecialUnits[random() % (sizeof(kSpecialUnits) / sizeof(kSpecialUnits[0]))];
+    }
+    return static_cast<wchar_t>(random() % 0x10000);
+}
+
+}
+
+int main() {
+#ifndef PATH_TEXT_SSE2
+    std::printf("built without SSE2: only the scalar code and WideCharToMultiByte are compared\n");
+#endif
+    size_t failed = 0;
+    size_t checked = 0;
+
+    // One special unit, or a surrogate pair, at every offset of an ASCII path.
+    for (size_t length = 1; length <= 40; ++length) {
+        for (size_t at = 0; at < length; ++at) {
+            for (wchar_t unit : kSpecialUnits) {
+                std::wstring text(length, L'a');
+                text[at] = unit;
+                failed += Agree(text) ? 0 : 1;
+                if (at + 1 < length) {
+                    text[at] = 0xD83D;
+                    text[at + 1] = 0xDE00;
+                    failed += Agree(text) ? 0 : 1;
+                    checked++;
+                }
+                checked++;
+            }
+        }
+    }
+
+    std::mt19937 random(1);
+    for (int i = 0; i < 1000000 && failed < 10; ++i) {
+        std::wstring text(random() % 48, L'\0');
+        for (wchar_t& unit : text) {
+            unit = RandomUnit(random);
+        }
+        failed += Agree(text) ? 0 : 1;
+        checked++;
+    }
+
+    std::printf("%zu of %zu strings mismatched\n", failed, checked);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+//
+// Stress test and contention benchmark for BlockingQueue. The stress part pushes known
+// sums through tiny queues from 1 to 64 producers and consumers, mixing single and batch
+// calls so both sides block constantly, and fails on any lost or duplicated item. The
+// benchmark then moves 2M items through a 1024-slot queue with equal numbers of producers
+// and consumers and prints Mops/s for Push/Pop, the batch calls and, for comparison, a
+// mutex and condition-variable queue. Build from the repository root and run:
+//
+//   g++ -std=c++17 -O2 tests/queue_bench.cpp -o queue_bench.exe -lvssapi -lsynchronization
+//   queue_bench.exe [--stress-only]
+//
+#define wmain BackupMain
+#include "../system_backup.cpp"
+#undef wmain
+
+namespace {
+
+// The mutex and condition-variable queue BlockingQueue replaced.
+template <typename T>
+class LockedQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit LockedQueue(size_t maxItems) : capacity(maxItems) {
+    }
+
+    void Push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    bool Pop(T& out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        out = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+constexpr int kThreadCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+// Every producer pushes 1..perProducer; true if the consumers received exactly that.
+bool Stress(int producers, int consumers, long perProducer, size_t capacity) {
+    BlockingQueue<long> queue(capacity);
+    std::atomic<long long> sum{ 0 };
+    std::vector<std::thread> threads;
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&, c] {
+            long long local = 0;
+            if (c % 2) {
+                long batch[8];
+                size_t count;
+                while ((count = queue.PopBatch(batch, 1 + c % 8)) > 0) {
+                    for (size_t i = 0; i < count; ++i) {
+                        local += batch[i];
+                    }
+                }
+            }
+            else {
+                long value;
+                while (queue.Pop(value)) {
+                    local += value;
+                }
+            }
+            sum += local;
+        });
+    }
+    std::vector<std::thread> pushers;
+    for (int p = 0; p < producers; ++p) {
+        pushers.emplace_back([&, p] {
+            if (p % 3 == 1) {
+                std::vector<long> batch;
+                for (long i = 1; i <= perProducer; ++i) {
+                    batch.push_back(i);
+                    if (batch.size() == 5) {
+                        queue.PushBatch(batch);
+                    }
+                }
+                queue.PushBatch(batch);
+            }
+            else {
+                for (long i = 1; i <= perProducer; ++i) {
+                    queue.Push(i);
+                }
+            }
+        });
+    }
+    for (auto& thread : pushers) {
+        thread.join();
+    }
+    queue.Close();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return sum == static_cast<long long>(producers) * perProducer * (perProducer + 1) / 2;
+}
+
+// Mops/s for 'threads' producers and as many consumers, or -1 if items went missing.
+template <typename Queue, bool Batch>
+double Throughput(int threads, long perProducer) {
+    Queue queue(1024);
+    std::atomic<long long> sum{ 0 };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < threads; ++c) {
+        consumers.emplace_back([&] {
+            long long local = 0;
+            if constexpr (Batch) {
+                long batch[16];
+                size_t count;
+                while ((count = queue.PopBatch(batch, 16)) > 0) {
+                    for (size_t i = 0; i < count; ++i) {
+                        local += batch[i];
+                    }
+                }
+            }
+            else {
+                long value;
+                while (queue.Pop(value)) {
+                    local += value;
+                }
+            }
+            sum += local;
+        });
+    }
+    std::vector<std::thread> producers;
+    for (int p = 0; p < threads; ++p) {
+        producers.emplace_back([&] {
+            for (long i = 1; i <= perProducer; ++i) {
+                queue.Push(i);
+            }
+        });
+    }
+    for (auto& thread : producers) {
+        thread.join();
+    }
+    queue.Close();
+    for (auto& thread : consumers) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (sum != static_cast<long long>(threads) * perProducer * (perProducer + 1) / 2) {
+        return -1;
+    }
+    return threads * perProducer / seconds / 1e6;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    int failed = 0;
+    int runs = 0;
+    for (int producers : kThreadCounts) {
+        for (int consumers : kThreadCounts) {
+            for (size_t capacity : { 2, 4, 64 }) {
+                failed += Stress(producers, consumers, 20000 / producers + 1, capacity) ? 0 : 1;
+                runs++;
+            }
+        }
+    }
+    std::printf("stress: %d of %d runs lost or duplicated items\n", failed, runs);
+    if (failed) {
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--stress-only") {
+        return 0;
+    }
+
+    std::printf("threads   Push/Pop   batch   mutex   (Mops/s, 2M items, 1024 slots)\n");
+    for (int threads : kThreadCounts) {
+        long perProducer = 2000000 / threads;
+        double ring = Throughput<BlockingQueue<long>, false>(threads, perProducer);
+        double batch = Throughput<BlockingQueue<long>, true>(threads, perProducer);
+        double locked = Throughput<LockedQueue<long>, false>(threads, perProducer);
+        if (ring < 0 || batch < 0 || locked < 0) {
+            std::printf("%2d+%-2d: items lost\n", threads, threads);
+            return 1;
+        }
+        std::printf("%2d+%-2d    %8.2f %7.2f %7.2f\n", threads, threads, ring, batch, locked);
+    }
+    return 0;
+}